@@ -0,0 +1,199 @@
+#include "rlut.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Usage: rlut-bench [output file] [largest map size]
+// Runs on the headless backend so no terminal is needed. Every result is
+// written as a line of JSON to the output file (bench.json by default)
+
+#define BENCH_MIN_TIME 0.25 // Seconds each benchmark runs for at least
+
+static struct {
+    FILE *output;
+    unsigned int frame;
+    volatile uint64_t sink;
+} state;
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void Report(const char *name, unsigned int width, unsigned int height, unsigned long iterations, double seconds) {
+    double ns = seconds * 1e9 / iterations;
+    fprintf(state.output, "{\"name\": \"%s\", \"width\": %u, \"height\": %u, \"iterations\": %lu, \"ns_per_op\": %.1f}\n",
+            name, width, height, iterations, ns);
+    fflush(state.output);
+    printf("%-24s %5ux%-5u %12.1f ns/op (%lu iterations)\n", name, width, height, ns, iterations);
+}
+
+// Keep doubling the number of iterations until the benchmark runs long enough
+#define BENCH(NAME, W, H, BODY)                                  \
+    do {                                                         \
+        unsigned long _n = 1;                                    \
+        for (;;) {                                               \
+            double _start = Now();                               \
+            for (unsigned long _i = 0; _i < _n; _i++) {          \
+                BODY;                                            \
+            }                                                    \
+            double _elapsed = Now() - _start;                    \
+            if (_elapsed >= BENCH_MIN_TIME || _n >= (1ul << 30)) { \
+                Report(NAME, W, H, _n, _elapsed);                \
+                break;                                           \
+            }                                                    \
+            _n *= 2;                                             \
+        }                                                        \
+    } while (0)
+
+static void PrintBenchmarks(void) {
+    static const char *plain = "The quick brown fox jumps over the lazy dog, 0123456789";
+    static const char *ansi = "\x1b[1;31mThe \x1b[32mquick \x1b[4;33mbrown \x1b[0;34mfox \x1b[45;36mjumps\x1b[0m \x1b[2Kover";
+    static const char *colors = "\x1b[38;5;196mhp \x1b[48;2;32;32;64;38;2;255;200;0m12/30\x1b[0;1;38;5;46m mp \x1b[22;39;49m7/9";
+    static const char *utf8 = "\xe2\x94\x8c\xe2\x94\x80 H\xc3\xa9ros \xe2\x94\x80\xe2\x94\x90 \xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e \xe2\x96\x91\xe2\x96\x92\xe2\x96\x93";
+    BENCH("print_string_plain", 0, 0, {
+        rlutSetCursor(0, 0);
+        rlutPrintString(plain);
+    });
+    BENCH("print_string_ansi", 0, 0, {
+        rlutSetCursor(0, 0);
+        rlutPrintString(ansi);
+    });
+    BENCH("print_string_colors", 0, 0, {
+        rlutSetCursor(0, 0);
+        rlutPrintString(colors);
+    });
+    rlutText *text = rlutCompileText(colors);
+    BENCH("draw_text_colors", 0, 0, rlutDrawText(text, 0, 0));
+    rlutDestroyText(text);
+    static const char *message = "You hit the \x1b[31morc\x1b[0m for 12 damage. The orc misses. You feel a draft coming from the east.";
+    BENCH("draw_text_box", 0, 0, rlutDrawTextBox(0, 0, 30, RLUT_ALIGN_LEFT, message));
+    BENCH("print_string_utf8", 0, 0, {
+        rlutSetCursor(0, 0);
+        rlutPrintString(utf8);
+    });
+    size_t plainLength = strlen(plain);
+    BENCH("print_string_n", 0, 0, {
+        rlutSetCursor(0, 0);
+        rlutPrintStringN(plain, plainLength);
+    });
+    BENCH("print_string_format", 0, 0, {
+        rlutSetCursor(0, 0);
+        rlutPrintString("%s %d %f", "hp", (int)_i, 1.5);
+    });
+    unsigned int width, height;
+    rlutScreenSize(&width, &height);
+    BENCH("print_char", 0, 0, {
+        if (_i % (width * height) == 0)
+            rlutSetCursor(0, 0);
+        rlutPrintChar('a' + _i % 26, RLUT_TEXT_DEFAULT, _i & 0xFF, 0);
+    });
+}
+
+// Every frame redraws the whole screen, half of the cells change colors
+static void Display(void) {
+    unsigned int width, height;
+    rlutScreenSize(&width, &height);
+    rlutSetCursor(0, 0);
+    for (unsigned int y = 0; y < height; y++)
+        for (unsigned int x = 0; x < width; x++)
+            rlutPrintChar('a' + (x + state.frame) % 26, RLUT_TEXT_DEFAULT,
+                          (x + y + state.frame) / 2 & 0xFF, (y / 4) & 0xFF);
+    state.frame++;
+}
+
+// Nothing changes between frames
+static void DisplayStatic(void) {
+    if (state.frame++)
+        return;
+    rlutClearScreen();
+    rlutPrintString("static frame");
+}
+
+// Draws to a layer that isn't next to the base layer, the layers in between
+// are never selected but still get flattened
+static void DisplayLayers(void) {
+    rlutLayer(3);
+    rlutSetCursor(0, state.frame % 4);
+    rlutPrintString("layer %u", state.frame);
+    rlutLayer(0);
+    state.frame++;
+}
+
+static void CompositorBenchmarks(void) {
+    static const unsigned int sizes[][2] = {
+        {80, 24}, {200, 60}, {400, 120}
+    };
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        rlutSetHint(RLUT_HINT_HEADLESS_COLUMNS, sizes[i][0]);
+        rlutSetHint(RLUT_HINT_HEADLESS_ROWS, sizes[i][1]);
+        rlutDisplayFunc(Display);
+        rlutMainLoopEvent(); // Resize + draw the first frame
+        BENCH("frame_full_redraw", sizes[i][0], sizes[i][1], rlutMainLoopEvent());
+        rlutFrameStats stats;
+        rlutGetFrameStats(&stats);
+        Report("compose_full_redraw", sizes[i][0], sizes[i][1], stats.frames,
+               stats.phases[RLUT_PHASE_COMPOSE].avg * stats.frames / 1000.0);
+        state.frame = 0;
+        rlutDisplayFunc(DisplayStatic);
+        BENCH("frame_static", sizes[i][0], sizes[i][1], rlutMainLoopEvent());
+        rlutGetFrameStats(&stats);
+        Report("compose_static", sizes[i][0], sizes[i][1], stats.frames,
+               stats.phases[RLUT_PHASE_COMPOSE].avg * stats.frames / 1000.0);
+    }
+    unsigned int last = sizeof(sizes) / sizeof(sizes[0]) - 1;
+    rlutDisplayFunc(DisplayLayers);
+    BENCH("frame_layers", sizes[last][0], sizes[last][1], rlutMainLoopEvent());
+}
+
+static void MapBenchmarks(unsigned int largest) {
+    for (unsigned int size = 64; size <= largest; size *= 4) {
+        BENCH("cellular_automata_map", size, size, {
+            uint8_t *map = rlutCellularAutomataMap(size, size, 45, 4, 4, 3);
+            state.sink += map[0];
+            free(map);
+        });
+        BENCH("perlin_noise_map", size, size, {
+            uint8_t *map = rlutPerlinNoiseMap(size, size, 0.f, 0.f, 0.f, 200.f, 2.f, .5f, 8.f);
+            state.sink += map[0];
+            free(map);
+        });
+        // Go from 4096 straight to 8192
+        if (size < largest && size * 4 > largest)
+            size = largest / 4;
+    }
+}
+
+static void NoiseBenchmarks(void) {
+    BENCH("perlin_noise", 0, 0, state.sink += rlutPerlinNoise(_i * .01f, _i * .02f, .5f) * 1000);
+    BENCH("random", 0, 0, state.sink += rlutRandom());
+    BENCH("random_float", 0, 0, state.sink += rlutRandomFloat() * 1000);
+    BENCH("random_int_range", 0, 0, state.sink += rlutRandomIntRange(-100, 100));
+    BENCH("random_float_range", 0, 0, state.sink += rlutRandomFloatRange(-1.f, 1.f) * 1000);
+}
+
+int main(int argc, const char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "bench.json";
+    unsigned int largest = argc > 2 ? atoi(argv[2]) : 8192;
+    if (!(state.output = fopen(path, "w"))) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return 1;
+    }
+    rlutSetHint(RLUT_HINT_BACKEND, RLUT_BACKEND_HEADLESS);
+    rlutSetHint(RLUT_HINT_DISABLE_IMGUI, 1);
+    rlutSetHint(RLUT_HINT_HEADLESS_COLUMNS, 200);
+    rlutSetHint(RLUT_HINT_HEADLESS_ROWS, 60);
+    rlutSetHint(RLUT_HINT_INITIAL_SEED, 1234);
+    if (!rlutInit(argc, argv))
+        abort();
+    PrintBenchmarks();
+    CompositorBenchmarks();
+    NoiseBenchmarks();
+    MapBenchmarks(largest);
+    rlutKillLoop();
+    rlutMainLoopEvent();
+    fclose(state.output);
+    return 0;
+}
@@ -19,16 +19,34 @@
 
 #include "rlut.h"
 #include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
 #include <ncurses.h>
 #include <time.h>
+#if !defined(RLUT_NO_IMGUI)
 #include "imtui/imtui.h"
 #include "imtui/imtui-impl-ncurses.h"
+#endif
 #include <limits>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <string>
-#include <sstream>
 #include <vector>
 #if defined(RLUT_SDL2)
+#include <SDL2/SDL.h>
 #if defined(_WIN32) || defined(_WIN64)
 #define RLUT_WINDOWS
 #include <windows.h>
@@ -41,8 +59,20 @@
 #endif
 #else
 #include <locale.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
 #endif
 
+typedef std::chrono::steady_clock Clock;
+
 inline std::uint8_t operator "" _u8(unsigned long long value) {
     return static_cast<std::uint8_t>(value);
 }
@@ -51,7 +81,7 @@ inline std::int8_t operator "" _i8(unsigned long long value) {
     return static_cast<std::int8_t>(value);
 }
 
-#define CLAMP(V, MN, MX) (std::min(std::max((V), (MN)), (MN)))
+#define CLAMP(V, MN, MX) (std::min(std::max((V), (MN)), (MX)))
 
 union Cell {
     struct {
@@ -64,8 +94,658 @@ union Cell {
     uint64_t value;
 };
 
+// East Asian wide + fullwidth characters take up 2 columns, the cell to the
+// right of one holds RLUT_WIDE_CONTINUATION instead of a character
+static const uint32_t wideRanges[][2] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+    {0x3041, 0x4DBF}, {0x4E00, 0xA4CF}, {0xA960, 0xA97F}, {0xAC00, 0xD7A3},
+    {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60},
+    {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F251}, {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB},
+    {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+static int CharWidth(uint32_t ch) {
+    if (ch < wideRanges[0][0])
+        return 1;
+    int lo = 0, hi = sizeof(wideRanges) / sizeof(wideRanges[0]) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ch < wideRanges[mid][0])
+            hi = mid - 1;
+        else if (ch > wideRanges[mid][1])
+            lo = mid + 1;
+        else
+            return 2;
+    }
+    return 1;
+}
+
+// Encode a character as UTF-8, returns the number of bytes written
+static int EncodeUTF8(uint32_t ch, char *out) {
+    if (ch < 0x80) {
+        out[0] = ch;
+        return 1;
+    }
+    if (ch < 0x800) {
+        out[0] = 0xC0 | (ch >> 6);
+        out[1] = 0x80 | (ch & 0x3F);
+        return 2;
+    }
+    if (ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF))
+        ch = 0xFFFD;
+    if (ch < 0x10000) {
+        out[0] = 0xE0 | (ch >> 12);
+        out[1] = 0x80 | ((ch >> 6) & 0x3F);
+        out[2] = 0x80 | (ch & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (ch >> 18);
+    out[1] = 0x80 | ((ch >> 12) & 0x3F);
+    out[2] = 0x80 | ((ch >> 6) & 0x3F);
+    out[3] = 0x80 | (ch & 0x3F);
+    return 4;
+}
+
+// Number of bytes in a UTF-8 sequence from its first byte, 0 if it can't start one
+static inline int UTF8Length(uint8_t lead) {
+    return lead < 0x80 ? 1 : lead < 0xC0 ? 0 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : lead < 0xF8 ? 4 : 0;
+}
+
+// Decode the next character of a UTF-8 string, returns the number of bytes
+// read. Malformed sequences are decoded a byte at a time as U+FFFD
+static int DecodeUTF8(const char *p, const char *end, uint32_t *ch) {
+    static const uint32_t minimum[4] = {0, 0x80, 0x800, 0x10000};
+    uint8_t lead = p[0];
+    int length = UTF8Length(lead);
+    if (length == 1) {
+        *ch = lead;
+        return 1;
+    }
+    *ch = 0xFFFD;
+    if (!length || end - p < length)
+        return 1;
+    uint32_t value = lead & (0x7F >> length);
+    for (int i = 1; i < length; i++) {
+        uint8_t c = p[i];
+        if ((c & 0xC0) != 0x80)
+            return 1;
+        value = value << 6 | (c & 0x3F);
+    }
+    // Overlong encodings, surrogates + anything past the last code point
+    if (value < minimum[length - 1] || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF))
+        return 1;
+    *ch = value;
+    return length;
+}
+
+// Screen buffers are a single contiguous block of cells aligned to
+// RLUT_BUFFER_ALIGN bytes, with each row `stride` cells apart. Building with
+// RLUT_SOA_BUFFER stores each field of the cells in its own plane instead of
+// packing them together, so clears, blits and comparisons only touch the
+// fields they need. Every row also keeps a hash of its cells that is updated
+// by each write, so the compositor can tell when a row is unchanged
+#ifndef RLUT_BUFFER_ALIGN
+#define RLUT_BUFFER_ALIGN 64
+#endif
+
+struct CellBuffer {
+    unsigned int w = 0, h = 0, stride = 0;
+    void *block = NULL;
+#if defined(RLUT_SOA_BUFFER)
+    uint32_t *characters = NULL;
+    int8_t *modes = NULL;
+    uint8_t *foregrounds = NULL;
+    uint8_t *backgrounds = NULL;
+    int8_t *used = NULL;
+#else
+    uint64_t *cells = NULL;
+#endif
+    uint64_t *hashes = NULL; // Hash of each row
+};
+
+static size_t AlignSize(size_t size) {
+    return (size + RLUT_BUFFER_ALIGN - 1) & ~(size_t)(RLUT_BUFFER_ALIGN - 1);
+}
+
+static inline Cell CellBufferGet(const CellBuffer *buf, unsigned int x, unsigned int y) {
+    size_t i = y * buf->stride + x;
+#if defined(RLUT_SOA_BUFFER)
+    Cell cell;
+    cell.character = buf->characters[i];
+    cell.mode = buf->modes[i];
+    cell.foreground = buf->foregrounds[i];
+    cell.background = buf->backgrounds[i];
+    cell.used = buf->used[i];
+    return cell;
+#else
+    return (Cell){.value=buf->cells[i]};
+#endif
+}
+
+// Hash of a cell in a column, a row's hash is the XOR of the hashes of its
+// cells so writes can swap a cell's hash out for the new one
+static inline uint64_t CellHash(uint64_t value, unsigned int x) {
+    uint64_t hash = value ^ (x * 0x9E3779B97F4A7C15ULL);
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    return hash ^ (hash >> 33);
+}
+
+static uint64_t CellBufferHashRun(const CellBuffer *buf, unsigned int x, unsigned int y, unsigned int w) {
+    uint64_t hash = 0;
+    for (unsigned int i = x; i < x + w; i++)
+        hash ^= CellHash(CellBufferGet(buf, i, y).value, i);
+    return hash;
+}
+
+static inline void CellBufferSet(CellBuffer *buf, unsigned int x, unsigned int y, Cell cell) {
+    size_t i = y * buf->stride + x;
+    buf->hashes[y] ^= CellHash(CellBufferGet(buf, x, y).value, x) ^ CellHash(cell.value, x);
+#if defined(RLUT_SOA_BUFFER)
+    buf->characters[i] = cell.character;
+    buf->modes[i] = cell.mode;
+    buf->foregrounds[i] = cell.foreground;
+    buf->backgrounds[i] = cell.background;
+    buf->used[i] = cell.used;
+#else
+    buf->cells[i] = cell.value;
+#endif
+}
+
+static void CellBufferFillRow(CellBuffer *buf, unsigned int x, unsigned int y, unsigned int w, Cell cell) {
+    size_t i = y * buf->stride + x;
+#if defined(RLUT_SOA_BUFFER)
+    std::fill(buf->characters + i, buf->characters + i + w, cell.character);
+    memset(buf->modes + i, cell.mode, w);
+    memset(buf->foregrounds + i, cell.foreground, w);
+    memset(buf->backgrounds + i, cell.background, w);
+    memset(buf->used + i, cell.used, w);
+#else
+    std::fill(buf->cells + i, buf->cells + i + w, cell.value);
+#endif
+}
+
+// Fill a rectangle of the buffer with a cell, rectangle must be inside the buffer
+static void CellBufferFill(CellBuffer *buf, unsigned int x, unsigned int y, unsigned int w, unsigned int h, uint64_t value) {
+    Cell cell = (Cell){.value=value};
+    for (unsigned int row = y; row < y + h; row++) {
+        uint64_t hash = 0;
+        for (unsigned int col = x; col < x + w; col++)
+            hash ^= CellHash(value, col);
+        hash ^= CellBufferHashRun(buf, x, row, w);
+        CellBufferFillRow(buf, x, row, w, cell);
+        buf->hashes[row] ^= hash;
+    }
+}
+
+// Copy rows of packed cells into the buffer, rectangle must be inside the buffer
+static void CellBufferBlit(CellBuffer *buf, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const uint64_t *cells, unsigned int stride) {
+    for (unsigned int row = 0; row < h; row++, cells += stride) {
+        size_t i = (y + row) * buf->stride + x;
+        uint64_t hash = CellBufferHashRun(buf, x, y + row, w);
+        for (unsigned int col = 0; col < w; col++)
+            hash ^= CellHash(cells[col], x + col);
+        buf->hashes[y + row] ^= hash;
+#if defined(RLUT_SOA_BUFFER)
+        for (unsigned int col = 0; col < w; col++) {
+            Cell cell = (Cell){.value=cells[col]};
+            buf->characters[i + col] = cell.character;
+            buf->modes[i + col] = cell.mode;
+            buf->foregrounds[i + col] = cell.foreground;
+            buf->backgrounds[i + col] = cell.background;
+            buf->used[i + col] = cell.used;
+        }
+#else
+        memcpy(buf->cells + i, cells, w * sizeof(uint64_t));
+#endif
+    }
+}
+
+// Copy rows of separate characters + colors into the buffer, NULL colors are
+// replaced with `fg` and `bg`. Rectangle must be inside the buffer
+static void CellBufferBlitPlanes(CellBuffer *buf, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const uint32_t *characters, const uint8_t *foregrounds, const uint8_t *backgrounds, unsigned int stride, int8_t mode, uint8_t fg, uint8_t bg) {
+    for (unsigned int row = 0; row < h; row++) {
+        size_t i = (y + row) * buf->stride + x, src = row * stride;
+        uint64_t hash = CellBufferHashRun(buf, x, y + row, w);
+#if defined(RLUT_SOA_BUFFER)
+        memcpy(buf->characters + i, characters + src, w * sizeof(uint32_t));
+        if (foregrounds)
+            memcpy(buf->foregrounds + i, foregrounds + src, w);
+        else
+            memset(buf->foregrounds + i, fg, w);
+        if (backgrounds)
+            memcpy(buf->backgrounds + i, backgrounds + src, w);
+        else
+            memset(buf->backgrounds + i, bg, w);
+        memset(buf->modes + i, mode, w);
+        memset(buf->used + i, 1, w);
+#else
+        Cell cell;
+        cell.mode = mode;
+        cell.foreground = fg;
+        cell.background = bg;
+        cell.used = 1;
+        for (unsigned int col = 0; col < w; col++) {
+            cell.character = characters[src + col];
+            if (foregrounds)
+                cell.foreground = foregrounds[src + col];
+            if (backgrounds)
+                cell.background = backgrounds[src + col];
+            buf->cells[i + col] = cell.value;
+        }
+#endif
+        buf->hashes[y + row] ^= hash ^ CellBufferHashRun(buf, x, y + row, w);
+    }
+}
+
+// Move rows `top` to `bottom` up by `n` rows, or down when `n` is negative.
+// The rows that are uncovered are filled with `fill`
+static void CellBufferScroll(CellBuffer *buf, unsigned int top, unsigned int bottom, int n, uint64_t fill) {
+    unsigned int count = bottom - top + 1, shift = std::min((unsigned int)std::abs(n), count);
+    if (shift < count) {
+        unsigned int dst = n > 0 ? top : top + shift, src = n > 0 ? top + shift : top;
+        size_t to = dst * buf->stride, from = src * buf->stride, length = (count - shift) * buf->stride;
+#if defined(RLUT_SOA_BUFFER)
+        memmove(buf->characters + to, buf->characters + from, length * sizeof(uint32_t));
+        memmove(buf->modes + to, buf->modes + from, length);
+        memmove(buf->foregrounds + to, buf->foregrounds + from, length);
+        memmove(buf->backgrounds + to, buf->backgrounds + from, length);
+        memmove(buf->used + to, buf->used + from, length);
+#else
+        memmove(buf->cells + to, buf->cells + from, length * sizeof(uint64_t));
+#endif
+        // Row hashes don't depend on the row, they move with the cells
+        memmove(buf->hashes + dst, buf->hashes + src, (count - shift) * sizeof(uint64_t));
+    }
+    CellBufferFill(buf, 0, n > 0 ? bottom + 1 - shift : top, buf->w, shift, fill);
+}
+
+static void CellBufferFree(CellBuffer *buf) {
+    if (buf->block)
+        RLUT_FREE(buf->block);
+    *buf = CellBuffer();
+}
+
+// Resize the buffer in a single allocation, any existing content that is still
+// inside the new bounds is kept and the rest is filled with `fill`
+static void CellBufferResize(CellBuffer *buf, unsigned int w, unsigned int h, uint64_t fill) {
+    if (buf->block && buf->w == w && buf->h == h)
+        return;
+    CellBuffer old = *buf;
+    CellBuffer result;
+    result.w = w;
+    result.h = h;
+    // Round the stride so every row starts on an aligned boundary
+#if defined(RLUT_SOA_BUFFER)
+    const unsigned int rowAlign = RLUT_BUFFER_ALIGN;
+#else
+    const unsigned int rowAlign = RLUT_BUFFER_ALIGN / sizeof(uint64_t);
+#endif
+    result.stride = (std::max(w, 1u) + rowAlign - 1) / rowAlign * rowAlign;
+    size_t n = static_cast<size_t>(result.stride) * std::max(h, 1u);
+#if defined(RLUT_SOA_BUFFER)
+    size_t planes[5] = {
+        AlignSize(n * sizeof(uint32_t)),
+        AlignSize(n * sizeof(int8_t)),
+        AlignSize(n * sizeof(uint8_t)),
+        AlignSize(n * sizeof(uint8_t)),
+        AlignSize(n * sizeof(int8_t))
+    };
+    size_t total = planes[0] + planes[1] + planes[2] + planes[3] + planes[4];
+#else
+    size_t total = AlignSize(n * sizeof(uint64_t));
+#endif
+    size_t hashes = total;
+    total += std::max(h, 1u) * sizeof(uint64_t);
+    result.block = RLUT_MALLOC(total + RLUT_BUFFER_ALIGN);
+    assert(result.block);
+    uint8_t *data = reinterpret_cast<uint8_t*>(AlignSize(reinterpret_cast<uintptr_t>(result.block)));
+    result.hashes = reinterpret_cast<uint64_t*>(data + hashes);
+#if defined(RLUT_SOA_BUFFER)
+    result.characters = reinterpret_cast<uint32_t*>(data);
+    result.modes = reinterpret_cast<int8_t*>(data += planes[0]);
+    result.foregrounds = reinterpret_cast<uint8_t*>(data += planes[1]);
+    result.backgrounds = reinterpret_cast<uint8_t*>(data += planes[2]);
+    result.used = reinterpret_cast<int8_t*>(data += planes[3]);
+#else
+    result.cells = reinterpret_cast<uint64_t*>(data);
+#endif
+    for (unsigned int y = 0; y < h; y++)
+        CellBufferFillRow(&result, 0, y, w, (Cell){.value=fill});
+    // Copy over whatever part of the old buffer still fits
+    if (old.block) {
+        unsigned int cw = std::min(old.w, w), ch = std::min(old.h, h);
+        for (unsigned int y = 0; y < ch; y++) {
+            size_t src = y * old.stride, dst = y * result.stride;
+#if defined(RLUT_SOA_BUFFER)
+            memcpy(result.characters + dst, old.characters + src, cw * sizeof(uint32_t));
+            memcpy(result.modes + dst, old.modes + src, cw);
+            memcpy(result.foregrounds + dst, old.foregrounds + src, cw);
+            memcpy(result.backgrounds + dst, old.backgrounds + src, cw);
+            memcpy(result.used + dst, old.used + src, cw);
+#else
+            memcpy(result.cells + dst, old.cells + src, cw * sizeof(uint64_t));
+#endif
+        }
+        CellBufferFree(&old);
+    }
+    for (unsigned int y = 0; y < h; y++)
+        result.hashes[y] = CellBufferHashRun(&result, 0, y, w);
+    *buf = result;
+}
+
+// Dirty regions are tracked as a span of columns for each row, marking a
+// rectangle widens the span of every row it covers. A row is clean when its
+// span is empty
+struct DirtyRegion {
+    std::vector<unsigned int> x0, x1;
+    unsigned int y0 = 0, y1 = 0; // Range of rows with a dirty span
+};
+
+static void DirtyRegionClear(DirtyRegion *region) {
+    std::fill(region->x0.begin(), region->x0.end(), UINT_MAX);
+    std::fill(region->x1.begin(), region->x1.end(), 0);
+    region->y0 = region->y1 = 0;
+}
+
+static void DirtyRegionResize(DirtyRegion *region, unsigned int h) {
+    region->x0.resize(h);
+    region->x1.resize(h);
+    DirtyRegionClear(region);
+}
+
+static void DirtyRegionMark(DirtyRegion *region, unsigned int x, unsigned int y, unsigned int w, unsigned int h) {
+    if (!w || !h)
+        return;
+    if (region->y0 == region->y1) {
+        region->y0 = y;
+        region->y1 = y + h;
+    } else {
+        region->y0 = std::min(region->y0, y);
+        region->y1 = std::max(region->y1, y + h);
+    }
+    for (unsigned int row = y; row < y + h; row++) {
+        region->x0[row] = std::min(region->x0[row], x);
+        region->x1[row] = std::max(region->x1[row], x + w);
+    }
+}
+
+#ifndef RLUT_MAX_LAYERS
+#define RLUT_MAX_LAYERS 8
+#endif
+
+// Layers are flattened bottom to top before the frame is composed, only the
+// regions that were drawn to since the last frame are flattened again
+struct Layer {
+    CellBuffer cells;
+    DirtyRegion dirty;
+    int mode = RLUT_LAYER_TRANSPARENT;
+};
+
+// Everything the draw functions read + write besides the target buffer. When a
+// panel is being drawn to, its state is swapped in for the screen's
+struct DrawState {
+    unsigned int w, h;
+    unsigned int cursorX, cursorY;
+    unsigned int savedCursorX, savedCursorY;
+    uint8_t textMode;
+    uint8_t backgroundColor;
+    uint8_t foregroundColor;
+};
+
+// Panels are offscreen boxes drawn over every layer in the order they were
+// created, they're only flattened again when drawn to or moved
+struct rlutPanel {
+    CellBuffer cells;
+    DirtyRegion dirty;
+    int x, y;
+    DrawState state;
+};
+
+// A run of composed cells that changed since the last frame and all share the
+// same colors + mode, `cells` points to the first cell in the back buffer
+struct Span {
+    uint16_t x, y, length;
+    int8_t mode;
+    uint8_t foreground, background;
+};
+
+// Escape sequences for one band of the frame, along with the cursor + style
+// the terminal will be left in once they have been written
+struct VTStream {
+    std::string output;
+    int x = -1, y = -1;
+    int foreground = -1, background = -1, mode = -1;
+    bool reset = true;
+};
+
+// Color pair state carried from one cell to the next while resolving a frame
+struct RunningColor {
+    uint16_t lastColorIndex, lastMainindex;
+    bool insideWindow;
+};
+
+// What each row of the back buffer was composed from, a row composed from the
+// same scene + ImTui rows with the same running color is left as it is
+struct RowState {
+    uint64_t sceneHash = 0, tuiHash = 0;
+    RunningColor start, end; // Running color at the start + end of the row
+    bool valid = false;
+    bool composed = false; // Row was composed this frame
+};
+
+// The screen is split into bands of rows that are composed on their own
+// thread, each band builds its own spans + VT output
+struct Band {
+    unsigned int y0, y1;
+    RunningColor in, out; // Running color at the start + end of the band
+    bool resolved = false; // `out` holds the last frame's running color
+    std::vector<Span> spans;
+    std::vector<uint64_t> mainRow;
+    VTStream vt;
+};
+
+// Worker threads for every band but the first, the main thread runs the first
+// band itself and then waits for the rest
+struct BandPool {
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake, done;
+    void(*job)(int band) = NULL;
+    unsigned int generation = 0, pending = 0;
+    bool stop = false;
+};
+
+// Rows of the screen scrolled with rlutScrollRegion this frame
+struct Scroll {
+    unsigned int top, bottom;
+    int n;
+};
+
+#define RLUT_ANSI_MAX_PARAMS 32
+
+// Escape sequence parser state, kept between prints so sequences + UTF-8
+// characters can be split across them
+struct AnsiParser {
+    uint8_t state = 0;
+    uint8_t marker = 0; // Private marker of a CSI sequence (< = > ?)
+    uint8_t intermediate = 0;
+    unsigned int count = 0; // Parameters so far, only the first RLUT_ANSI_MAX_PARAMS are kept
+    uint16_t params[RLUT_ANSI_MAX_PARAMS];
+    char utf8[4]; // Start of a character cut off by the end of the last print
+    unsigned int utf8Length = 0;
+};
+
+// Compiled text is kept as the runs of cells that were printed to, the cells of
+// every run are stored one after the other
+struct TextRun {
+    uint16_t x, y, length;
+    uint32_t offset;
+};
+
+struct rlutText {
+    unsigned int w, h; // Size of the area printed to
+    std::vector<TextRun> runs;
+    std::vector<uint64_t> cells;
+};
+
+// Word wrapped text boxes, keyed by the string, box width + text style. Only
+// the width of each line is kept so the same layout is drawn for any alignment
+#define RLUT_LAYOUT_CACHE_SIZE 256
+
+struct Layout {
+    uint64_t hash;
+    std::string str;
+    unsigned int width;
+    uint32_t style;
+    rlutText *text = NULL;
+    std::vector<uint16_t> lines; // Width of each line
+    uint64_t lastUsed;
+};
+
+struct LayoutCache {
+    std::vector<Layout> entries;
+    std::vector<int16_t> slots; // Open addressing into `entries`, -1 is empty
+    uint64_t clock = 0;
+};
+
+// Output backends draw the spans built by the compositor, `flush` is called
+// once every span of the frame has been drawn. Backends that can draw bands
+// in parallel set `drawBand`, which is called from each band's thread.
+// Backends that can scroll rows of the screen set `scrollRows`, which is called
+// for each scroll of the frame before any spans are drawn
+struct Backend {
+    void(*init)(void);
+    void(*shutdown)(void);
+    void(*screenSize)(unsigned int *width, unsigned int *height);
+    void(*newFrame)(void);
+    void(*drawSpan)(const Span *span, const uint64_t *cells);
+    void(*drawBand)(int band);
+    void(*scrollRows)(unsigned int top, unsigned int bottom, int n);
+    void(*flush)(void);
+    void(*wait)(void);
+    void(*beep)(void);
+    int(*inputFd)(void);
+};
+
+#ifndef RLUT_MAX_COLOR_PAIRS
+#define RLUT_MAX_COLOR_PAIRS 4096
+#endif
+
+// NCurses color pairs are cached in a small open addressing table keyed by
+// the foreground + background colors. Once every pair the terminal supports
+// is in use, the least recently used pair is re-initialized with new colors
+struct ColorPairCache {
+    int capacity = 0, count = 0;
+    unsigned int mask = 0;
+    std::vector<uint16_t> slots; // Pair number in each slot, 0 if empty
+    std::vector<uint16_t> keys; // Colors of each pair number
+    std::vector<uint16_t> prev, next; // Recently used list, 0 terminated
+    uint16_t head = 0, tail = 0; // Most + least recently used pairs
+};
+
+struct Timer {
+    Clock::time_point when;
+    void(*func)(int);
+    int value;
+};
+
+// Frames are recorded as a delta against the previous frame, encoded on the
+// main thread and written out by a background thread
+struct Recorder {
+    FILE *file = NULL;
+    std::vector<uint64_t> previous;
+    unsigned int columns = 0, rows = 0, frame = 0;
+    std::vector<uint8_t> encoded; // Frames waiting to be written
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread writer;
+    bool stop = false;
+};
+
+// Draw commands are recorded on any thread into a command buffer's arena and
+// handed to the main thread when submitted. Each command is a header followed
+// by its arguments, padded to 8 bytes
+enum {
+    RLUT_COMMAND_LAYER = 0,
+    RLUT_COMMAND_PANEL,
+    RLUT_COMMAND_CLEAR,
+    RLUT_COMMAND_SET_CURSOR,
+    RLUT_COMMAND_PRINT_CHAR,
+    RLUT_COMMAND_PRINT,
+    RLUT_COMMAND_BLIT,
+    RLUT_COMMAND_FILL
+};
+
+struct Command {
+    uint32_t type, size; // Size of the arguments that follow
+};
+
+struct CommandRect {
+    int x, y;
+    unsigned int w, h;
+    uint64_t cell; // Fill only, blits are followed by w * h cells
+};
+
+struct rlutCommandBuffer {
+    int order;
+    uint32_t id, sequence = 0; // Buffers with the same order go by creation, then submission
+    std::vector<uint8_t> arena;
+};
+
+struct SubmittedCommands {
+    int order;
+    uint32_t id, sequence;
+    std::vector<uint8_t> arena;
+};
+
+struct CommandQueue {
+    std::mutex lock;
+    std::vector<SubmittedCommands> pending;
+    std::vector<std::vector<uint8_t>> spare; // Arenas that were applied, reused on submit
+    uint32_t nextId = 0;
+};
+
+#ifndef RLUT_STATS_WINDOW
+#define RLUT_STATS_WINDOW 128
+#endif
+
+// Phase timings of the last RLUT_STATS_WINDOW frames in nanoseconds, the
+// rolling min/avg/p99 are only worked out when they are asked for
+struct FrameStats {
+    std::array<std::array<uint64_t, RLUT_STATS_WINDOW>, RLUT_PHASE_COUNT> samples;
+    unsigned int count = 0, next = 0;
+    Clock::time_point frameStart, phaseStart;
+    uint64_t bytes = 0, cells = 0, pairSwitches = 0; // Frame being run
+    uint64_t lastBytes = 0, lastCells = 0, lastPairSwitches = 0;
+    uint64_t totalBytes = 0, totalCells = 0, totalPairSwitches = 0;
+    rlutPanel *overlay = NULL;
+};
+
+static const Backend* FindBackend(int backend);
+static void InitEvents(void);
+static void ClearLayouts(void);
+static void ApplyCommandBuffers(void);
+static void ClearCommandBuffers(void);
+
 static struct {
-    ImTui::TScreen* tuiScreen;
+    const Backend *backend;
+#if !defined(RLUT_NO_IMGUI)
+    ImTui::TScreen* tuiScreen = NULL;
+#endif
+    bool imgui = false;
     void(*displayFunc)(void)     = NULL;
     void(*preframeFunc)(void)    = NULL;
     void(*postframeFunc)(void)   = NULL;
@@ -79,9 +759,56 @@ static struct {
     uint8_t textMode;
     uint8_t backgroundColor;
     uint8_t foregroundColor;
-    std::vector<std::vector<uint64_t>> screenBuffer = {{0}};
-    std::array<std::pair<bool, int>, 256*256> colPairs;
-    uint16_t colPairsIndex = 1;
+    AnsiParser ansi;
+    LayoutCache layouts;
+    std::array<Layer, RLUT_MAX_LAYERS> layers;
+    unsigned int layer = 0, layerCount = 1; // Layer being drawn to + number of layers in use
+    CellBuffer composite; // Flattened layers + panels, unused with a single layer
+    bool compositeStale = true; // Composite buffer hasn't been kept up to date
+    std::vector<rlutPanel*> panels;
+    rlutPanel *panel = NULL; // Panel being drawn to
+    DirtyRegion panelDamage; // Screen regions panels were moved from or to
+    std::vector<uint64_t> frontBuffer, backBuffer;
+    const CellBuffer *scene = NULL; // Flattened layers being composed
+    std::vector<uint8_t> overlayMask; // ImTui cells that cover the scene
+    std::vector<uint8_t> overlayRows; // Rows with any ImTui cells
+    std::vector<RowState> rows;
+    std::vector<Scroll> scrolls;
+    bool rowsDisableRunning = false; // RLUT_HINT_DISABLE_RUNNING_COLOR the rows were composed with
+    std::vector<Span> spans;
+    std::vector<Band> bands;
+    BandPool pool;
+    std::vector<Timer> timers;
+    struct {
+        std::atomic<bool> pending{true}; // Screen size has to be checked
+        int generation = 0; // Resizes so far, for coalescing reshape calls
+#if defined(SIGWINCH)
+        struct sigaction previous; // Handler to chain to, installed by NCurses
+        bool installed = false;
+#endif
+    } resize;
+    struct {
+        int wakeup[2] = {-1, -1};
+        int timer = -1;
+        std::atomic<bool> dirty{true};
+        int activeFrames = 0;
+        Clock::time_point lastFrame;
+    } events;
+    ColorPairCache colorPairs;
+    Recorder recorder;
+    CommandQueue commands;
+    FrameStats stats;
+    struct {
+        unsigned int width, height; // Framebuffer size in pixels
+        std::vector<uint32_t> framebuffer;
+        std::vector<uint32_t> atlas; // Glyph masks, a pixel per element
+        uint32_t palette[256];
+#if defined(RLUT_SDL2)
+        SDL_Window *window;
+        SDL_Renderer *renderer;
+        SDL_Texture *texture;
+#endif
+    } pixel;
     std::array<int, RLUT_HINT_LAST+1> hints = {
         15,  // RLUT_HINT_DEFAULT_FOREGROUND_COLOR
         0,   // RLUT_HINT_DEFAULT_BACKGROUND_COLOR
@@ -89,28 +816,78 @@ static struct {
         480, // RLUT_HINT_WINDOW_HEIGHT
         0,   // RLUT_HINT_DISABLE_TEXT_WRAP
         0,   // RLUT_HINT_DISABLE_TEXT_AUTO_ADVANCE
+        0,   // RLUT_HINT_ENABLE_Y_WRAP
         0,   // RLUT_HINT_DISABLE_UTF8
-        0,   // RLUT_HINT_DISABLE_RUNNING_STATE
-        0    // RLUT_HINT_INITIAL_SEED
+        0,   // RLUT_HINT_DISABLE_RUNNING_COLOR
+        0,   // RLUT_HINT_INITIAL_SEED
+        RLUT_BACKEND_NCURSES, // RLUT_HINT_BACKEND
+        0,   // RLUT_HINT_ENABLE_TRUECOLOR
+        80,  // RLUT_HINT_HEADLESS_COLUMNS
+        24,  // RLUT_HINT_HEADLESS_ROWS
+#if defined(RLUT_NO_IMGUI)
+        1,   // RLUT_HINT_DISABLE_IMGUI
+#else
+        0,   // RLUT_HINT_DISABLE_IMGUI
+#endif
+        60,  // RLUT_HINT_FRAME_RATE
+        0,   // RLUT_HINT_ENABLE_EVENT_LOOP
+        300, // RLUT_HINT_RECORD_KEYFRAME_INTERVAL
+        0,   // RLUT_HINT_SHOW_FRAME_STATS
+        1    // RLUT_HINT_COMPOSITOR_THREADS
     };
 } rlut;
 
 int rlutInit(int argc, const char *argv[]) {
     if (!rlut.hints[RLUT_HINT_DISABLE_UTF8])
         setlocale(LC_ALL, ""); // For NCurses
-    IMGUI_CHECKVERSION();
-    ImGui::CreateContext();
-    rlut.tuiScreen = ImTui_ImplNcurses_Init(true);
-    ImTui_ImplText_Init();
+    if (!(rlut.backend = FindBackend(rlut.hints[RLUT_HINT_BACKEND])))
+        return 0;
+#if !defined(RLUT_NO_IMGUI)
+    if ((rlut.imgui = !rlut.hints[RLUT_HINT_DISABLE_IMGUI])) {
+        IMGUI_CHECKVERSION();
+        ImGui::CreateContext();
+    }
+#endif
+    rlut.backend->init();
+#if !defined(RLUT_NO_IMGUI)
+    if (rlut.imgui)
+        ImTui_ImplText_Init();
+#endif
+    InitEvents();
     rlutScreenSize(&rlut.screenW, &rlut.screenH);
     rlutClearScreen();
     rlutSetSeed(rlut.hints[RLUT_HINT_INITIAL_SEED]);
+    rlut.running = true;
     return 1;
 }
 
 void rlutSetHint(unsigned int key, int val) {
-    if (key < rlut.hints.size())
-        rlut.hints[key] = val;
+    if (key >= rlut.hints.size())
+        return;
+#if defined(RLUT_NO_IMGUI)
+    if (key == RLUT_HINT_DISABLE_IMGUI)
+        val = 1;
+#endif
+    bool changed = rlut.hints[key] != val;
+    rlut.hints[key] = val;
+    switch (key) {
+        case RLUT_HINT_WINDOW_WIDTH:
+        case RLUT_HINT_WINDOW_HEIGHT:
+        case RLUT_HINT_HEADLESS_COLUMNS:
+        case RLUT_HINT_HEADLESS_ROWS:
+            rlut.resize.pending = true;
+            break;
+        // Cached text box layouts were printed with the old value
+        case RLUT_HINT_DEFAULT_FOREGROUND_COLOR:
+        case RLUT_HINT_DEFAULT_BACKGROUND_COLOR:
+        case RLUT_HINT_DISABLE_TEXT_WRAP:
+        case RLUT_HINT_DISABLE_TEXT_AUTO_ADVANCE:
+        case RLUT_HINT_ENABLE_Y_WRAP:
+        case RLUT_HINT_DISABLE_UTF8:
+            if (changed)
+                ClearLayouts();
+            break;
+    }
 }
 
 void rlutDisplayFunc(void(*func)(void)) {
@@ -147,198 +924,2253 @@ uint64_t DefaultCellValue(void) {
     return DefaultCell().value;
 }
 
+// The buffer draw functions write into
+static inline CellBuffer* Target(void) {
+    return rlut.panel ? &rlut.panel->cells : &rlut.layers[rlut.layer].cells;
+}
+
+// Mark a rectangle of the layer or panel being drawn to as changed
+static inline void MarkDirty(unsigned int x, unsigned int y, unsigned int w, unsigned int h) {
+    DirtyRegionMark(rlut.panel ? &rlut.panel->dirty : &rlut.layers[rlut.layer].dirty, x, y, w, h);
+}
+
+static void ResizeLayer(Layer *layer) {
+    // The screen's size is swapped out for the panel's while drawing to a panel
+    unsigned int w = rlut.panel ? rlut.panel->state.w : rlut.screenW;
+    unsigned int h = rlut.panel ? rlut.panel->state.h : rlut.screenH;
+    if (layer->cells.block && layer->cells.w == w && layer->cells.h == h)
+        return;
+    CellBufferResize(&layer->cells, w, h, DefaultCellValue());
+    DirtyRegionResize(&layer->dirty, h);
+    DirtyRegionMark(&layer->dirty, 0, 0, w, h);
+}
+
+// Milliseconds the screen size has to settle for before the reshape callback
+// is called, so dragging a window around only reshapes once
+#ifndef RLUT_RESHAPE_DELAY
+#define RLUT_RESHAPE_DELAY 100
+#endif
+
+static void ReshapeTimer(int generation) {
+    if (generation == rlut.resize.generation && rlut.reshapeFunc)
+        rlut.reshapeFunc(rlut.screenW, rlut.screenH);
+}
+
+// The screen size is only checked after SIGWINCH or a size hint changing.
+// Everything sized to the screen is resized together, layers keep whatever
+// part of their content still fits
 static void ResizeScreenBuffer(void) {
-    int lastW = rlut.screenW, lastH = rlut.screenH;
-    rlutScreenSize(&rlut.screenW, &rlut.screenH);
-    
-    if (lastH != rlut.screenH) {
-        // Has the window's height shrunk?
-        if (lastH > rlut.screenH)
-            rlut.screenBuffer.resize(rlut.screenH);
-        else { // Has it grown?
-            uint64_t cell = DefaultCellValue();
-            for (int x = 0; x < rlut.screenH - lastH; x++)
-                rlut.screenBuffer.push_back(std::vector<uint64_t>(rlut.screenW, cell));
-        }
+    if (!rlut.resize.pending.exchange(false))
+        return;
+    unsigned int width, height;
+    rlutScreenSize(&width, &height);
+    bool first = rlut.backBuffer.empty();
+    if (width == rlut.screenW && height == rlut.screenH && !first)
+        return;
+    rlut.screenW = width;
+    rlut.screenH = height;
+    for (unsigned int i = 0; i < rlut.layerCount; i++)
+        ResizeLayer(&rlut.layers[i]);
+    DirtyRegionResize(&rlut.panelDamage, height);
+#if !defined(RLUT_NO_IMGUI)
+    if (rlut.imgui) {
+        rlut.tuiScreen->resize(width, height);
+        rlut.tuiScreen->clear();
     }
-    
-    if (lastW != rlut.screenW) {
-        // Has the window's width shrunk?
-        if (lastW > rlut.screenW)
-            for (int y = 0; y < rlut.screenH; y++)
-                rlut.screenBuffer[y].resize(rlut.screenW);
-        else { // Has it grown?
-            uint64_t cell = DefaultCellValue();
-            int n = rlut.screenW - lastW;
-            for (int y = 0; y < rlut.screenH; y++)
-                for (int x = 0; x < n; x++)
-                    rlut.screenBuffer[y].push_back(cell);
-        }
-    }
-
-    // Size changed, call reshape callback if it's set
-    if ((rlut.screenW != lastW || rlut.screenH != lastH) && rlut.reshapeFunc)
-        rlut.reshapeFunc(rlut.screenW, rlut.screenH);
+#endif
+    // Frame buffers are resized + the last frame is invalidated so that
+    // the next frame is redrawn from scratch
+    rlut.backBuffer.assign(width * height, 0);
+    rlut.frontBuffer.assign(width * height, 0);
+    rlut.overlayMask.assign(width * height, 0);
+    rlut.overlayRows.assign(height, 0);
+    rlut.rows.assign(height, RowState());
+    rlut.scrolls.clear();
+    // The first frame is reshaped straight away, after that the reshape
+    // callback waits for the size to settle
+    if (first) {
+        if (rlut.reshapeFunc)
+            rlut.reshapeFunc(width, height);
+    } else
+        rlutTimerFunc(RLUT_RESHAPE_DELAY, ReshapeTimer, ++rlut.resize.generation);
 }
 
 void rlutKillLoop(void) {
     rlut.running = false;
+    rlutPostRedisplay();
 }
 
-static Cell ImTuiCell(int x, int y) {
-    ImTui::TCell *tcell = &rlut.tuiScreen->data[y * rlut.screenW + x];
-    return (Cell) {
-        .character = *tcell & 0x0000FFFF,
-        .foreground = static_cast<uint8_t>((*tcell & 0x00FF0000) >> 16),
-        .background = static_cast<uint8_t>((*tcell & 0xFF000000) >> 24),
-        .mode = -1,
-        .used = 1
+#if !defined(RLUT_NO_IMGUI)
+// Expand an ImTui cell into an RLUT cell
+static inline uint64_t TuiCellValue(ImTui::TCell tcell) {
+    // character = 0x0000FFFF, mode = -1, foreground + background, used = 1
+    uint64_t high = ((tcell >> 8) & 0x00FFFF00) | 0x010000FF;
+    return (tcell & 0x0000FFFF) | (high << 32);
+}
+
+// ImTui cells are only drawn when they have a character and a color
+static inline bool TuiCellFilled(ImTui::TCell tcell) {
+    return (tcell & 0x0000FFFF) && (tcell >> 16);
+}
+
+// Merge a row of ImTui cells over a row of RLUT cells, taking the ImTui cell
+// wherever it's filled. `mask` is set to 1 for every cell taken from ImTui,
+// returns how many cells were taken from ImTui
+static int BlendOverlayRow(const ImTui::TCell *tui, const uint64_t *main, uint64_t *out, uint8_t *mask, int width) {
+    int x = 0, count = 0;
+#if defined(__SSE2__)
+    // Mask bytes for each combination of 4 filled flags
+    static const uint32_t maskBytes[16] = {
+        0x00000000, 0x00000001, 0x00000100, 0x00000101,
+        0x00010000, 0x00010001, 0x00010100, 0x00010101,
+        0x01000000, 0x01000001, 0x01000100, 0x01000101,
+        0x01010000, 0x01010001, 0x01010100, 0x01010101
     };
+    const __m128i characterMask = _mm_set1_epi32(0x0000FFFF);
+    const __m128i colorMask = _mm_set1_epi32(0x00FFFF00);
+    const __m128i highBits = _mm_set1_epi32(0x010000FF);
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 4 <= width; x += 4) {
+        // Expand 4 ImTui cells into low + high halves of RLUT cells
+        __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tui + x));
+        __m128i low = _mm_and_si128(t, characterMask);
+        __m128i high = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(t, 8), colorMask), highBits);
+        __m128i empty = _mm_or_si128(_mm_cmpeq_epi32(low, zero),
+                                     _mm_cmpeq_epi32(_mm_srli_epi32(t, 16), zero));
+        __m128i cells0 = _mm_unpacklo_epi32(low, high);
+        __m128i cells1 = _mm_unpackhi_epi32(low, high);
+        __m128i empty0 = _mm_unpacklo_epi32(empty, empty);
+        __m128i empty1 = _mm_unpackhi_epi32(empty, empty);
+#if defined(__AVX2__)
+        __m256i cells = _mm256_inserti128_si256(_mm256_castsi128_si256(cells0), cells1, 1);
+        __m256i empties = _mm256_inserti128_si256(_mm256_castsi128_si256(empty0), empty1, 1);
+        __m256i mains = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(main + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), _mm256_blendv_epi8(cells, mains, empties));
+#else
+        __m128i main0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(main + x));
+        __m128i main1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(main + x + 2));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x),
+                         _mm_or_si128(_mm_and_si128(empty0, main0), _mm_andnot_si128(empty0, cells0)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x + 2),
+                         _mm_or_si128(_mm_and_si128(empty1, main1), _mm_andnot_si128(empty1, cells1)));
+#endif
+        int filled = ~_mm_movemask_ps(_mm_castsi128_ps(empty)) & 0xF;
+        memcpy(mask + x, &maskBytes[filled], 4);
+        count += __builtin_popcount(filled);
+    }
+#endif
+    for (; x < width; x++)
+        if (TuiCellFilled(tui[x])) {
+            out[x] = TuiCellValue(tui[x]);
+            mask[x] = 1;
+            count++;
+        } else {
+            out[x] = main[x];
+            mask[x] = 0;
+        }
+    return count;
+}
+#endif
+
+// Find the first cell from `x` that differs between the two rows
+static int FirstDifference(const uint64_t *a, const uint64_t *b, int x, int width) {
+#if defined(__AVX2__)
+    for (; x + 4 <= width; x += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + x)),
+                                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + x)));
+        unsigned int bits = _mm256_movemask_epi8(eq);
+        if (bits != 0xFFFFFFFF)
+            return x + __builtin_ctz(~bits) / 8;
+    }
+#elif defined(__SSE2__)
+    for (; x + 2 <= width; x += 2) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x)),
+                                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x)));
+        unsigned int bits = _mm_movemask_epi8(eq);
+        if (bits != 0xFFFF)
+            return x + __builtin_ctz(~bits) / 8;
+    }
+#endif
+    while (x < width && a[x] == b[x])
+        x++;
+    return x;
 }
 
 static uint16_t ColorPairIndex(uint8_t fg, uint8_t bg) {
     return bg * 256 + fg;
 }
 
-static void EnsureColorPair(uint8_t fg, uint8_t bg) {
-    uint16_t p = ColorPairIndex(fg, bg);
-    if (!rlut.colPairs[p].first) {
-        init_pair(rlut.colPairsIndex, fg, bg);
-        rlut.colPairs[p] = std::pair<bool, int>(true, COLOR_PAIR(rlut.colPairsIndex++));
+static unsigned int ColorPairHash(uint16_t key) {
+    return (key * 0x9E3779B1u) >> 16 & rlut.colorPairs.mask;
+}
+
+static void InitColorPairs(void) {
+    ColorPairCache &cache = rlut.colorPairs;
+    // Pair 0 is reserved by NCurses + pair numbers have to fit in a short
+    cache.capacity = std::max(std::min(COLOR_PAIRS - 1, std::min(RLUT_MAX_COLOR_PAIRS, SHRT_MAX)), 1);
+    cache.count = cache.head = cache.tail = 0;
+    unsigned int size = 1;
+    while (size < (unsigned int)cache.capacity * 2)
+        size <<= 1;
+    cache.mask = size - 1;
+    cache.slots.assign(size, 0);
+    cache.keys.assign(cache.capacity + 1, 0);
+    cache.prev.assign(cache.capacity + 1, 0);
+    cache.next.assign(cache.capacity + 1, 0);
+}
+
+static void UnlinkColorPair(uint16_t pair) {
+    ColorPairCache &cache = rlut.colorPairs;
+    if (cache.prev[pair])
+        cache.next[cache.prev[pair]] = cache.next[pair];
+    else
+        cache.head = cache.next[pair];
+    if (cache.next[pair])
+        cache.prev[cache.next[pair]] = cache.prev[pair];
+    else
+        cache.tail = cache.prev[pair];
+}
+
+static void LinkColorPair(uint16_t pair) {
+    ColorPairCache &cache = rlut.colorPairs;
+    cache.prev[pair] = 0;
+    cache.next[pair] = cache.head;
+    if (cache.head)
+        cache.prev[cache.head] = pair;
+    cache.head = pair;
+    if (!cache.tail)
+        cache.tail = pair;
+}
+
+// Remove a slot from the table, shifting back any entries that were probed
+// past it so lookups don't stop early
+static void RemoveColorPairSlot(unsigned int i) {
+    ColorPairCache &cache = rlut.colorPairs;
+    for (unsigned int j = (i + 1) & cache.mask; cache.slots[j]; j = (j + 1) & cache.mask) {
+        unsigned int home = ColorPairHash(cache.keys[cache.slots[j]]);
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            cache.slots[i] = cache.slots[j];
+            i = j;
+        }
     }
-    attron(rlut.colPairs[p].second);
+    cache.slots[i] = 0;
 }
 
-static void SetColorPair(uint16_t index) {
-    if (rlut.colPairs[index].first)
-        attron(rlut.colPairs[index].second);
+// Any cells on screen drawn with a pair that was just re-initialized will
+// change color, so they have to be redrawn next frame
+static void InvalidateColorPair(uint16_t key) {
+    for (size_t i = 0; i < rlut.frontBuffer.size(); i++) {
+        Cell cell = (Cell){.value=rlut.frontBuffer[i]};
+        if (ColorPairIndex(cell.foreground, cell.background) == key) {
+            rlut.frontBuffer[i] = 0;
+            rlut.rows[i / rlut.screenW].valid = false;
+        }
+    }
+    rlutPostRedisplay();
 }
 
-int rlutMainLoop(void) {
-    assert(rlut.displayFunc);
-    rlut.running = true;
-    while (rlut.running) {
-        ImTui_ImplNcurses_NewFrame();
-        ImTui_ImplText_NewFrame();
-        ImGui::NewFrame();
-        
-        ResizeScreenBuffer();
-        
-        if (rlut.preframeFunc)
-            rlut.preframeFunc();
-        
-        rlut.displayFunc();
-        
-        ImGui::Begin("test");
-        ImGui::Text("Hello, world!");
-        ImGui::End();
-        
-        ImGui::Render();
-        ImTui_ImplText_RenderDrawData(ImGui::GetDrawData(), rlut.tuiScreen);
-        
-        // Rendering RLUT + ImTui screen buffers to NCurses
-        uint8_t defaultForeground = rlut.hints[RLUT_HINT_DEFAULT_FOREGROUND_COLOR];
-        uint8_t defaultBackground = rlut.hints[RLUT_HINT_DEFAULT_BACKGROUND_COLOR];
-        EnsureColorPair(defaultForeground, defaultBackground);
-        uint16_t lastColorIndex = ColorPairIndex(defaultForeground, defaultBackground);
-        uint16_t lastMainindex = lastColorIndex;
-        bool insideWindow = false;
-        for (int y = 0; y < rlut.screenH; y++) {
-            // The current row's buffer. Will be flushed either at the end of the
-            // row or when there is a color change.
-            std::string row = "";
-            for (int x = 0; x < rlut.screenW; x++) {
-                // Get the cells from both ImTui and RLUT screen buffers and
-                // both cells color pair indices.
-                Cell tcell = ImTuiCell(x, y);
-                Cell mcell = (Cell){.value=rlut.screenBuffer[y][x]};
-                uint16_t tpairIndex = ColorPairIndex(tcell.foreground, tcell.background);
-                uint16_t mpairIndex = ColorPairIndex(mcell.foreground, mcell.background);
-                // If check if ImTui's cell is filled, otherwise we use RLUT's cell
-                Cell cell;
-                uint16_t pairIndex;
-                bool force = false;
-                if (tcell.character > 0 && (tcell.background > 0 || tcell.foreground > 0)) {
-                    pairIndex = tpairIndex;
-                    cell = tcell;
-                    insideWindow = true;
-                } else {
-                    pairIndex = mpairIndex;
-                    cell = mcell;
-                    // If we were inside a window in the last cell and the current
-                    // RLUT cell is unused, we copy the last RLUT cell's state.
-                    // We keep constant track of RLUT's cell state so that it emulates
-                    // right underneath ImTui windows
-                    if (insideWindow && !cell.used) {
-                        pairIndex = lastMainindex;
-                        // To keep things simple, just use a flag to force
-                        // ncurses to use the old color pair index
-                        force = true;
-                    }
-                    insideWindow = false;
-                }
-                // If we're not forcing the index and the cell isn't used, set
-                // the cell's character to an empty space and skip to the end
-                if (!force && !cell.used) {
-                    cell.character = ' ';
-                    goto END;
-                }
-                
-                // If we're forcing the index or the current pair index is different
-                // to the last one, we flush the row to the screen and update the
-                // color pair inside ncurses
-                if (force || pairIndex != lastColorIndex) {
-                    if (!row.empty()) {
-                        addstr(row.data());
-                        row.clear();
-                    }
-                    if (force)
-                        SetColorPair(pairIndex);
-                    else
-                        EnsureColorPair(cell.foreground, cell.background);
-                    lastColorIndex = pairIndex;
-                }
-                
-            END:
-                // Add the cell's character to the row buffer and update the
-                // RLUT cell state tracker. We have to keep track of this constantly
-                // so that no matter where the ImTui windows are we can keep the
-                // main RLUT screen buffer the right state
-                if (mcell.used || rlut.hints[RLUT_HINT_DISABLE_RUNNING_COLOR])
-                    lastMainindex = mpairIndex;
-                row.push_back(cell.character ? cell.character : ' ');
+// Find or create the color pair for the colors, returns the pair number
+static short EnsureColorPair(uint8_t fg, uint8_t bg) {
+    ColorPairCache &cache = rlut.colorPairs;
+    if (!cache.capacity)
+        InitColorPairs();
+    uint16_t key = ColorPairIndex(fg, bg);
+    unsigned int i = ColorPairHash(key);
+    for (; cache.slots[i]; i = (i + 1) & cache.mask)
+        if (cache.keys[cache.slots[i]] == key) {
+            uint16_t pair = cache.slots[i];
+            if (cache.head != pair) {
+                UnlinkColorPair(pair);
+                LinkColorPair(pair);
             }
-            // If there is anything in the row buffer remaining, flush it
-            if (!row.empty())
-                addstr(row.data());
+            return pair;
         }
-        
-        ImTui_ImplNcurses_UpdateScreen();
+    uint16_t pair;
+    if (cache.count < cache.capacity)
+        pair = ++cache.count;
+    else {
+        // Out of pairs, recycle the least recently used one
+        pair = cache.tail;
+        UnlinkColorPair(pair);
+        unsigned int j = ColorPairHash(cache.keys[pair]);
+        while (cache.slots[j] != pair)
+            j = (j + 1) & cache.mask;
+        RemoveColorPairSlot(j);
+        InvalidateColorPair(cache.keys[pair]);
+        // Removing the old slot might have shifted the empty slot we found
+        for (i = ColorPairHash(key); cache.slots[i]; i = (i + 1) & cache.mask);
     }
-    
-    if (rlut.postframeFunc)
-        rlut.postframeFunc();
-    
-    if (rlut.atExitFunc)
-        rlut.atExitFunc();
-    ImTui_ImplText_Shutdown();
-    ImTui_ImplNcurses_Shutdown();
-    return 0;
+    init_pair(pair, fg, bg);
+    cache.keys[pair] = key;
+    cache.slots[i] = pair;
+    LinkColorPair(pair);
+    return pair;
 }
 
-static void ClearScreenBuffer(void) {
-    uint64_t cell = DefaultCellValue();
-    rlut.screenBuffer.clear();
-    rlut.screenBuffer.reserve(rlut.screenH);
-    for (int y = 0; y < rlut.screenH; y++)
-        rlut.screenBuffer.push_back(std::vector<uint64_t>(rlut.screenW, cell));
-    rlut.cursorX = rlut.cursorY = 0;
-    move(0, 0);
+static attr_t ModeAttributes(int8_t mode) {
+    switch (mode) {
+        case RLUT_TEXT_BOLD:
+            return A_BOLD;
+        case RLUT_TEXT_DIM:
+            return A_DIM;
+#if defined(A_ITALIC)
+        case RLUT_TEXT_ITALIC:
+            return A_ITALIC;
+#endif
+        case RLUT_TEXT_UNDERLINE:
+            return A_UNDERLINE;
+        case RLUT_TEXT_BLINKING:
+            return A_BLINK;
+        case RLUT_TEXT_INVERSE:
+            return A_REVERSE;
+        case RLUT_TEXT_HIDDEN:
+            return A_INVIS;
+        default:
+            return A_NORMAL;
+    }
 }
 
-void rlutClearScreen(void) {
-    ClearScreenBuffer();
-    wrefresh(stdscr);
+// Cells that haven't changed but sit between two changed runs closer than this
+// are redrawn anyway, it's cheaper than moving the cursor again
+#define RLUT_DIFF_GAP 4
+
+// The mode, foreground and background bytes of a cell
+#define RLUT_CELL_STYLE 0x00FFFFFF00000000ULL
+
+// Compare a row of the back buffer against the last frame sent to the
+// terminal and add spans for the runs of cells that differ
+static void DiffRow(int y, std::vector<Span> *spans) {
+    uint64_t *back = &rlut.backBuffer[y * rlut.screenW];
+    uint64_t *front = &rlut.frontBuffer[y * rlut.screenW];
+    int width = rlut.screenW, x = 0;
+    while ((x = FirstDifference(back, front, x, width)) < width) {
+        // Find the end of the changed run, swallowing any small gaps
+        int start = x, end = x, same = 0;
+        for (; x < width; x++)
+            if (back[x] != front[x]) {
+                end = x + 1;
+                same = 0;
+            } else if (++same > RLUT_DIFF_GAP)
+                break;
+        // 2 column characters are drawn whole, from the left half
+        if (start > 0 && ((Cell){.value=back[start]}).character == RLUT_WIDE_CONTINUATION)
+            start--;
+        if (end < width && ((Cell){.value=back[end]}).character == RLUT_WIDE_CONTINUATION)
+            end++;
+        // Split the run into spans that share the same colors + mode, the
+        // right half of a 2 column character stays with the left half
+        for (int i = start; i < end;) {
+            uint64_t style = back[i] & RLUT_CELL_STYLE;
+            int j = i + 1;
+            while (j < end && ((back[j] & RLUT_CELL_STYLE) == style ||
+                               ((Cell){.value=back[j]}).character == RLUT_WIDE_CONTINUATION))
+                j++;
+            Cell cell = (Cell){.value=back[i]};
+            Span span;
+            span.x = i;
+            span.y = y;
+            span.length = j - i;
+            span.mode = cell.mode;
+            span.foreground = cell.foreground;
+            span.background = cell.background;
+            spans->push_back(span);
+            i = j;
+        }
+        std::copy(back + start, back + end, front + start);
+    }
+}
+
+// Apply a layer's cell on top of the cells below it
+static inline uint64_t BlendLayerCell(uint64_t below, uint64_t above, int mode) {
+    Cell cell = (Cell){.value=above};
+    switch (mode) {
+        case RLUT_LAYER_OPAQUE:
+            return above;
+        case RLUT_LAYER_KEEP_BACKGROUND:
+            if (!cell.used)
+                return below;
+            cell.background = ((Cell){.value=below}).background;
+            return cell.value;
+        case RLUT_LAYER_HIDDEN:
+            return below;
+        case RLUT_LAYER_TRANSPARENT:
+        default:
+            return cell.used ? above : below;
+    }
+}
+
+// Mark the part of a screen rectangle that is on screen as damaged
+static void DamageScreenRect(int x, int y, unsigned int w, unsigned int h) {
+    int x0 = std::max(x, 0), y0 = std::max(y, 0);
+    int x1 = std::min(x + (int)w, (int)rlut.screenW), y1 = std::min(y + (int)h, (int)rlut.screenH);
+    if (x0 < x1 && y0 < y1 && rlut.panelDamage.x0.size() == rlut.screenH)
+        DirtyRegionMark(&rlut.panelDamage, x0, y0, x1 - x0, y1 - y0);
+}
+
+// Move the dirty regions of a panel into screen space
+static void DamagePanel(rlutPanel *panel) {
+    const DirtyRegion *dirty = &panel->dirty;
+    for (unsigned int y = dirty->y0; y < dirty->y1; y++)
+        if (dirty->x0[y] < dirty->x1[y])
+            DamageScreenRect(panel->x + dirty->x0[y], panel->y + y, dirty->x1[y] - dirty->x0[y], 1);
+    DirtyRegionClear(&panel->dirty);
+}
+
+// Flatten the regions of the layers + panels that changed since the last frame
+// into the composite buffer, returns the buffer the compositor should read.
+// With a single layer and no panels there is nothing to flatten and the base
+// layer is read directly
+static const CellBuffer* FlattenLayers(void) {
+    if (rlut.layerCount == 1 && rlut.panels.empty()) {
+        DirtyRegionClear(&rlut.layers[0].dirty);
+        rlut.compositeStale = true;
+        return &rlut.layers[0].cells;
+    }
+    CellBufferResize(&rlut.composite, rlut.screenW, rlut.screenH, DefaultCellValue());
+    if (rlut.compositeStale) {
+        DirtyRegionMark(&rlut.panelDamage, 0, 0, rlut.screenW, rlut.screenH);
+        rlut.compositeStale = false;
+    }
+    for (size_t i = 0; i < rlut.panels.size(); i++)
+        DamagePanel(rlut.panels[i]);
+    const DirtyRegion *regions[RLUT_MAX_LAYERS + 1];
+    unsigned int regionCount = 0;
+    regions[regionCount++] = &rlut.panelDamage;
+    for (unsigned int i = 0; i < rlut.layerCount; i++)
+        regions[regionCount++] = &rlut.layers[i].dirty;
+    unsigned int y0 = UINT_MAX, y1 = 0;
+    for (unsigned int i = 0; i < regionCount; i++) {
+        if (regions[i]->y0 == regions[i]->y1)
+            continue;
+        y0 = std::min(y0, regions[i]->y0);
+        y1 = std::max(y1, regions[i]->y1);
+    }
+    for (unsigned int y = y0; y < y1; y++) {
+        unsigned int x0 = UINT_MAX, x1 = 0;
+        for (unsigned int i = 0; i < regionCount; i++) {
+            x0 = std::min(x0, regions[i]->x0[y]);
+            x1 = std::max(x1, regions[i]->x1[y]);
+        }
+        for (unsigned int x = x0; x < x1; x++) {
+            uint64_t value = CellBufferGet(&rlut.layers[0].cells, x, y).value;
+            for (unsigned int i = 1; i < rlut.layerCount; i++)
+                if (rlut.layers[i].mode != RLUT_LAYER_HIDDEN)
+                    value = BlendLayerCell(value, CellBufferGet(&rlut.layers[i].cells, x, y).value, rlut.layers[i].mode);
+            CellBufferSet(&rlut.composite, x, y, (Cell){.value=value});
+        }
+        // Panels are opaque, copy the part of each panel that covers the span
+        for (size_t i = 0; x0 < x1 && i < rlut.panels.size(); i++) {
+            const rlutPanel *panel = rlut.panels[i];
+            int py = (int)y - panel->y;
+            if (py < 0 || py >= (int)panel->cells.h)
+                continue;
+            int px0 = std::max((int)x0, panel->x), px1 = std::min((int)x1, panel->x + (int)panel->cells.w);
+            for (int x = px0; x < px1; x++)
+                CellBufferSet(&rlut.composite, x, y, CellBufferGet(&panel->cells, x - panel->x, py));
+        }
+    }
+    for (unsigned int i = 0; i < regionCount; i++)
+        DirtyRegionClear(const_cast<DirtyRegion*>(regions[i]));
+    return &rlut.composite;
+}
+
+static void BandWorker(int band, unsigned int generation) {
+    BandPool *pool = &rlut.pool;
+    for (;;) {
+        void(*job)(int);
+        {
+            std::unique_lock<std::mutex> lock(pool->lock);
+            while (!pool->stop && pool->generation == generation)
+                pool->wake.wait(lock);
+            if (pool->stop)
+                return;
+            generation = pool->generation;
+            job = pool->job;
+        }
+        job(band);
+        std::lock_guard<std::mutex> lock(pool->lock);
+        if (!--pool->pending)
+            pool->done.notify_one();
+    }
+}
+
+static void StopBandPool(void) {
+    BandPool *pool = &rlut.pool;
+    {
+        std::lock_guard<std::mutex> lock(pool->lock);
+        pool->stop = true;
+        pool->wake.notify_all();
+    }
+    for (size_t i = 0; i < pool->threads.size(); i++)
+        pool->threads[i].join();
+    pool->threads.clear();
+    pool->stop = false;
+}
+
+// Run a job on every band and wait for all of them to finish
+static void RunBands(void(*job)(int band)) {
+    BandPool *pool = &rlut.pool;
+    if (!pool->threads.empty()) {
+        std::lock_guard<std::mutex> lock(pool->lock);
+        pool->job = job;
+        pool->pending = (unsigned int)pool->threads.size();
+        pool->generation++;
+        pool->wake.notify_all();
+    }
+    job(0);
+    if (!pool->threads.empty()) {
+        std::unique_lock<std::mutex> lock(pool->lock);
+        while (pool->pending)
+            pool->done.wait(lock);
+    }
+}
+
+// Split the screen into RLUT_HINT_COMPOSITOR_THREADS bands of rows, the
+// workers are only restarted when the number of bands changes
+static void UpdateBands(void) {
+    unsigned int count = std::max(1, std::min(rlut.hints[RLUT_HINT_COMPOSITOR_THREADS], (int)rlut.screenH));
+    if (count != rlut.bands.size()) {
+        StopBandPool();
+        rlut.bands.resize(count);
+        for (unsigned int i = 1; i < count; i++)
+            rlut.pool.threads.push_back(std::thread(BandWorker, (int)i, rlut.pool.generation));
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        rlut.bands[i].y0 = rlut.screenH * i / count;
+        rlut.bands[i].y1 = rlut.screenH * (i + 1) / count;
+    }
+}
+
+// Resolve the final character + colors of a cell. `source` is the ImTui cell
+// when `overlay` is set, otherwise it's the same as `main`
+static inline uint64_t ResolveCell(RunningColor *state, uint64_t main, uint64_t source, bool overlay, bool disableRunning) {
+    Cell mcell = (Cell){.value=main};
+    Cell cell = (Cell){.value=source};
+    uint16_t mpairIndex = ColorPairIndex(mcell.foreground, mcell.background);
+    if (overlay) {
+        // ImTui's cell is filled, its pair becomes active
+        state->lastColorIndex = ColorPairIndex(cell.foreground, cell.background);
+        state->insideWindow = true;
+    } else {
+        // If we were inside a window in the last cell and the current
+        // RLUT cell is unused, we copy the last RLUT cell's state.
+        // We keep constant track of RLUT's cell state so that it emulates
+        // right underneath ImTui windows
+        if (state->insideWindow && !cell.used)
+            state->lastColorIndex = state->lastMainindex;
+        else if (cell.used)
+            state->lastColorIndex = mpairIndex;
+        else {
+            // Unused cells are drawn as an empty space in whatever
+            // color pair is currently active
+            cell.character = ' ';
+            cell.mode = -1;
+        }
+        state->insideWindow = false;
+    }
+    // Update the RLUT cell state tracker. We have to keep track of this
+    // constantly so that no matter where the ImTui windows are we can
+    // keep the main RLUT screen buffer the right state
+    if (mcell.used || disableRunning)
+        state->lastMainindex = mpairIndex;
+    cell.foreground = state->lastColorIndex & 0xFF;
+    cell.background = state->lastColorIndex >> 8;
+    if (!cell.character)
+        cell.character = ' ';
+    cell.used = 1;
+    return cell.value;
+}
+
+static bool SameRunningColor(const RunningColor *a, const RunningColor *b) {
+    return a->lastColorIndex == b->lastColorIndex &&
+           a->lastMainindex == b->lastMainindex &&
+           a->insideWindow == b->insideWindow;
+}
+
+#if !defined(RLUT_NO_IMGUI)
+// ImTui draws a fresh screen every frame, so its rows are hashed as they are
+static uint64_t HashTuiRow(const ImTui::TCell *tui, unsigned int width) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (unsigned int x = 0; x < width; x++)
+        hash = (hash ^ tui[x]) * 0x100000001B3ULL;
+    return hash;
+}
+#endif
+
+// Layers, panels + ImTui can cover half of a 2 column character, whatever is
+// left of it is drawn as a space
+static void FixWideChars(uint64_t *row) {
+    bool utf8 = !rlut.hints[RLUT_HINT_DISABLE_UTF8];
+    uint32_t last = 0;
+    for (unsigned int x = 0; x < rlut.screenW; x++) {
+        Cell cell = (Cell){.value=row[x]};
+        uint32_t ch = cell.character;
+        bool broken;
+        if (ch == RLUT_WIDE_CONTINUATION)
+            broken = !utf8 || CharWidth(last) != 2;
+        else
+            broken = utf8 && CharWidth(ch) == 2 &&
+                     (x + 1 == rlut.screenW || ((Cell){.value=row[x + 1]}).character != RLUT_WIDE_CONTINUATION);
+        if (broken) {
+            cell.character = ' ';
+            row[x] = cell.value;
+        }
+        last = ch;
+    }
+}
+
+// Resolve the RLUT + ImTui screen buffers of a band into the back buffer a row
+// at a time, starting from the band's guess of the running color
+static void ResolveBand(int index) {
+    Band *band = &rlut.bands[index];
+    const CellBuffer *scene = rlut.scene;
+    bool disableRunning = rlut.hints[RLUT_HINT_DISABLE_RUNNING_COLOR];
+    RunningColor state = band->in;
+    for (unsigned int y = band->y0; y < band->y1; y++) {
+        uint64_t *row = &rlut.backBuffer[y * rlut.screenW];
+        uint8_t *mask = &rlut.overlayMask[y * rlut.screenW];
+        RowState *cache = &rlut.rows[y];
+        uint64_t tuiHash = 0;
+#if !defined(RLUT_NO_IMGUI)
+        if (rlut.imgui)
+            tuiHash = HashTuiRow(&rlut.tuiScreen->data[y * rlut.screenW], rlut.screenW);
+#endif
+        if ((cache->composed = !cache->valid ||
+                               cache->sceneHash != scene->hashes[y] ||
+                               cache->tuiHash != tuiHash ||
+                               !SameRunningColor(&cache->start, &state))) {
+            cache->sceneHash = scene->hashes[y];
+            cache->tuiHash = tuiHash;
+            cache->start = state;
+            cache->valid = true;
+        } else {
+            // Row is the same as last frame, the back buffer still holds it
+            state = cache->end;
+            continue;
+        }
+#if defined(RLUT_SOA_BUFFER)
+        band->mainRow.resize(rlut.screenW);
+        for (unsigned int x = 0; x < rlut.screenW; x++)
+            band->mainRow[x] = CellBufferGet(scene, x, y).value;
+        const uint64_t *main = band->mainRow.data();
+#else
+        const uint64_t *main = scene->cells + y * scene->stride;
+#endif
+        // Without ImGui there is nothing to blend, the RLUT cells are read
+        // straight from the screen buffer
+        const uint64_t *src = main;
+        int overlay = 0;
+#if !defined(RLUT_NO_IMGUI)
+        if (rlut.imgui && (overlay = BlendOverlayRow(&rlut.tuiScreen->data[y * rlut.screenW], main, row, mask, rlut.screenW)))
+            src = row;
+#endif
+        rlut.overlayRows[y] = overlay != 0;
+        for (unsigned int x = 0; x < rlut.screenW; x++)
+            row[x] = ResolveCell(&state, main[x], src[x], overlay && mask[x], disableRunning);
+        FixWideChars(row);
+        cache->end = state;
+    }
+    band->out = state;
+    band->resolved = true;
+}
+
+// Each band after the first was resolved from a guess of the running color it
+// starts with. Once the band before it is final, resolve the start of the band
+// again with the real state until it matches the guess, usually within a cell
+// or two as any used cell resets the running color
+static void FixBandStarts(void) {
+    bool disableRunning = rlut.hints[RLUT_HINT_DISABLE_RUNNING_COLOR];
+    for (size_t i = 1; i < rlut.bands.size(); i++) {
+        Band *band = &rlut.bands[i];
+        RunningColor actual = rlut.bands[i - 1].out, guess = band->in;
+        bool matched = false;
+        for (unsigned int y = band->y0; y < band->y1 && !matched; y++) {
+            if ((matched = SameRunningColor(&actual, &guess)))
+                break;
+            uint64_t *row = &rlut.backBuffer[y * rlut.screenW];
+            const uint8_t *mask = &rlut.overlayMask[y * rlut.screenW];
+            RowState *cache = &rlut.rows[y];
+            cache->start = actual;
+            cache->composed = true;
+            for (unsigned int x = 0; x < rlut.screenW; x++) {
+                if ((matched = SameRunningColor(&actual, &guess)))
+                    break;
+                // ImTui cells were already resolved to their own colors
+                bool overlay = rlut.overlayRows[y] && mask[x];
+                uint64_t main = CellBufferGet(rlut.scene, x, y).value;
+                uint64_t source = overlay ? row[x] : main;
+                ResolveCell(&guess, main, source, overlay, disableRunning);
+                row[x] = ResolveCell(&actual, main, source, overlay, disableRunning);
+            }
+            FixWideChars(row);
+            if (!matched)
+                cache->end = actual;
+        }
+        if (!matched)
+            band->out = actual;
+    }
+}
+
+static void DiffBand(int index) {
+    Band *band = &rlut.bands[index];
+    band->spans.clear();
+    for (unsigned int y = band->y0; y < band->y1; y++)
+        if (rlut.rows[y].composed)
+            DiffRow(y, &band->spans);
+}
+
+// Shift the rows of the last frame the same way the backend is about to scroll
+// them, the rows that scroll into view are unknown and have to be drawn
+static void ScrollFrontBuffer(const Scroll *scroll) {
+    unsigned int count = scroll->bottom - scroll->top + 1, shift = std::abs(scroll->n);
+    uint64_t *front = &rlut.frontBuffer[scroll->top * rlut.screenW];
+    if (scroll->n > 0) {
+        std::copy(front + shift * rlut.screenW, front + count * rlut.screenW, front);
+        std::fill(front + (count - shift) * rlut.screenW, front + count * rlut.screenW, 0);
+    } else {
+        std::copy_backward(front, front + (count - shift) * rlut.screenW, front + count * rlut.screenW);
+        std::fill(front, front + shift * rlut.screenW, 0);
+    }
+    // Skipped rows rely on the back + front buffers matching
+    for (unsigned int y = scroll->top; y <= scroll->bottom; y++)
+        rlut.rows[y].valid = false;
+}
+
+// Resolve the RLUT + ImTui screen buffers into the back buffer. Each cell of
+// the back buffer holds the exact character + colors that will be drawn, so it
+// can be compared against the last frame that was sent to the terminal, any
+// differences are added to the frame's spans. The bands are resolved + diffed
+// in parallel, only fixing up the running color between them is serial
+static void ComposeFrame(void) {
+    uint8_t defaultForeground = rlut.hints[RLUT_HINT_DEFAULT_FOREGROUND_COLOR];
+    uint8_t defaultBackground = rlut.hints[RLUT_HINT_DEFAULT_BACKGROUND_COLOR];
+    RunningColor start;
+    start.lastColorIndex = start.lastMainindex = ColorPairIndex(defaultForeground, defaultBackground);
+    start.insideWindow = false;
+    UpdateBands();
+    rlut.scene = FlattenLayers();
+    if (rlut.backend->scrollRows) {
+        for (size_t i = 0; i < rlut.scrolls.size(); i++)
+            ScrollFrontBuffer(&rlut.scrolls[i]);
+    } else
+        rlut.scrolls.clear();
+    // Every row depends on the running color hint, changing it redraws them
+    bool disableRunning = rlut.hints[RLUT_HINT_DISABLE_RUNNING_COLOR];
+    if (disableRunning != rlut.rowsDisableRunning) {
+        rlut.rows.assign(rlut.screenH, RowState());
+        rlut.rowsDisableRunning = disableRunning;
+    }
+    // Each band after the first guesses it starts with the running color the
+    // band before it ended with last frame. The rows' cached start colors are
+    // the fixed up ones, so on a static screen the guess matches + every row
+    // is skipped
+    for (size_t i = 0; i < rlut.bands.size(); i++)
+        rlut.bands[i].in = i && rlut.bands[i - 1].resolved ? rlut.bands[i - 1].out : start;
+    RunBands(ResolveBand);
+    FixBandStarts();
+    RunBands(DiffBand);
+    rlut.spans.clear();
+    for (size_t i = 0; i < rlut.bands.size(); i++)
+        rlut.spans.insert(rlut.spans.end(), rlut.bands[i].spans.begin(), rlut.bands[i].spans.end());
+}
+
+#if defined(SIGWINCH)
+// Only flag the resize + wake the loop, NCurses' own handler is still called
+// so it picks up the new size when it next reads input
+static void HandleResize(int sig, siginfo_t *info, void *context) {
+    rlut.resize.pending = true;
+    const struct sigaction *previous = &rlut.resize.previous;
+    if (previous->sa_flags & SA_SIGINFO) {
+        if (previous->sa_sigaction)
+            previous->sa_sigaction(sig, info, context);
+    } else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN)
+        previous->sa_handler(sig);
+    int saved = errno;
+    rlutPostRedisplay();
+    errno = saved;
+}
+#endif
+
+static void InstallResizeHandler(void) {
+#if defined(SIGWINCH)
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = HandleResize;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    rlut.resize.installed = sigaction(SIGWINCH, &action, &rlut.resize.previous) == 0;
+#endif
+}
+
+static void RemoveResizeHandler(void) {
+#if defined(SIGWINCH)
+    if (rlut.resize.installed)
+        sigaction(SIGWINCH, &rlut.resize.previous, NULL);
+    rlut.resize.installed = false;
+#endif
+}
+
+// Without ImGui, NCurses is set up the same way ImTui would have
+static void NcursesInit(void) {
+#if !defined(RLUT_NO_IMGUI)
+    if (rlut.imgui) {
+        rlut.tuiScreen = ImTui_ImplNcurses_Init(true);
+        InstallResizeHandler();
+        return;
+    }
+#endif
+    initscr();
+    use_default_colors();
+    start_color();
+    cbreak();
+    noecho();
+    curs_set(0);
+    nodelay(stdscr, TRUE);
+    wtimeout(stdscr, 0);
+    set_escdelay(25);
+    keypad(stdscr, true);
+    InstallResizeHandler();
+}
+
+static void NcursesShutdown(void) {
+    RemoveResizeHandler();
+#if !defined(RLUT_NO_IMGUI)
+    if (rlut.imgui) {
+        ImTui_ImplNcurses_Shutdown();
+        rlut.tuiScreen = NULL;
+        return;
+    }
+#endif
+    endwin();
+}
+
+static void NcursesScreenSize(unsigned int *width, unsigned int *height) {
+    unsigned int col, row;
+#if defined(TIOCGWINSZ)
+    // NCurses only picks up a new size when it next reads input, which might
+    // have happened before the resize. Ask the terminal instead
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col && size.ws_row &&
+        (size.ws_col != COLS || size.ws_row != LINES))
+        resizeterm(size.ws_row, size.ws_col);
+#endif
+    getmaxyx(stdscr, row, col);
+    if (width)
+        *width = col;
+    if (height)
+        *height = row;
+}
+
+static void NcursesNewFrame(void) {
+#if !defined(RLUT_NO_IMGUI)
+    if (rlut.imgui) {
+        ImTui_ImplNcurses_NewFrame();
+        return;
+    }
+#endif
+    // Nothing consumes input without ImGui yet, drain it so it doesn't pile
+    // up. This also lets NCurses handle any resizes
+    while (wgetch(stdscr) != ERR);
+}
+
+// Characters are passed to NCurses as UTF-8, it works out the widths itself
+static void NcursesDrawSpan(const Span *span, const uint64_t *cells) {
+    char str[256];
+    bool utf8 = !rlut.hints[RLUT_HINT_DISABLE_UTF8];
+    move(span->y, span->x);
+    attr_set(ModeAttributes(span->mode), EnsureColorPair(span->foreground, span->background), NULL);
+    int n = 0;
+    for (int i = 0; i < span->length; i++) {
+        uint32_t ch = (Cell){.value=cells[i]}.character;
+        if (ch < 0x80 || !utf8)
+            str[n++] = ch;
+        else if (ch != RLUT_WIDE_CONTINUATION)
+            n += EncodeUTF8(ch, str + n);
+        // Leave room for the longest sequence
+        if (n > (int)sizeof(str) - 4) {
+            addnstr(str, n);
+            n = 0;
+        }
+    }
+    if (n)
+        addnstr(str, n);
+}
+
+// NCurses keeps its own copy of the screen in step, and moves the lines on
+// the terminal with the scroll region + index commands it finds
+static void NcursesScroll(unsigned int top, unsigned int bottom, int n) {
+    setscrreg(top, bottom);
+    scrollok(stdscr, TRUE);
+    scrl(n);
+    scrollok(stdscr, FALSE);
+    setscrreg(0, LINES - 1);
+}
+
+static void NcursesFlush(void) {
+    refresh();
+}
+
+static Clock::duration FrameInterval(void) {
+    return std::chrono::microseconds(1000000 / std::max(rlut.hints[RLUT_HINT_FRAME_RATE], 1));
+}
+
+// Sleep until the next frame is due
+static void WaitFrame(void) {
+    static Clock::time_point next = Clock::now();
+    Clock::time_point now = Clock::now();
+    next += FrameInterval();
+    if (next < now)
+        next = now;
+    else
+        std::this_thread::sleep_until(next);
+}
+
+static void NcursesWait(void) {
+#if !defined(RLUT_NO_IMGUI)
+    if (rlut.imgui) {
+        ImTui_ImplNcurses_UpdateScreen();
+        return;
+    }
+#endif
+    WaitFrame();
+}
+
+static void NcursesBeep(void) {
+    beep();
+}
+
+static int NcursesInputFd(void) {
+    return STDIN_FILENO;
+}
+
+static void AppendInt(std::string &out, unsigned int value) {
+    char buf[10];
+    int n = 0;
+    do
+        buf[n++] = '0' + value % 10;
+    while (value /= 10);
+    while (n)
+        out.push_back(buf[--n]);
+}
+
+// Convert an index of the xterm 256 color palette to RGB
+static void PaletteColor(uint8_t index, uint8_t *r, uint8_t *g, uint8_t *b) {
+    static const uint8_t system[16][3] = {
+        {0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0},
+        {0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+        {127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0},
+        {92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255}
+    };
+    static const uint8_t levels[6] = {0, 95, 135, 175, 215, 255};
+    if (index < 16) {
+        *r = system[index][0];
+        *g = system[index][1];
+        *b = system[index][2];
+    } else if (index < 232) {
+        index -= 16;
+        *r = levels[index / 36];
+        *g = levels[(index / 6) % 6];
+        *b = levels[index % 6];
+    } else
+        *r = *g = *b = 8 + (index - 232) * 10;
+}
+
+// Find the closest color of the xterm 256 color cube or grey ramp, the system
+// colors are left out as every terminal has its own idea of them
+static uint8_t NearestPaletteColor(uint8_t r, uint8_t g, uint8_t b) {
+    const int rgb[3] = {r, g, b}, scale[3] = {36, 6, 1};
+    int cube = 16, cubeDistance = 0;
+    for (int i = 0; i < 3; i++) {
+        int level = rgb[i] < 48 ? 0 : rgb[i] < 115 ? 1 : (rgb[i] - 35) / 40;
+        int value = level ? 55 + level * 40 : 0;
+        cube += level * scale[i];
+        cubeDistance += (rgb[i] - value) * (rgb[i] - value);
+    }
+    int grey = std::min(std::max(((r + g + b) / 3 - 3) / 10, 0), 23);
+    int value = 8 + grey * 10, greyDistance = 0;
+    for (int i = 0; i < 3; i++)
+        greyDistance += (rgb[i] - value) * (rgb[i] - value);
+    return greyDistance < cubeDistance ? 232 + grey : cube;
+}
+
+static void AppendColor(std::string &out, int base, uint8_t color) {
+    AppendInt(out, base);
+    if (rlut.hints[RLUT_HINT_ENABLE_TRUECOLOR]) {
+        uint8_t r, g, b;
+        PaletteColor(color, &r, &g, &b);
+        out.append(";2;");
+        AppendInt(out, r);
+        out.push_back(';');
+        AppendInt(out, g);
+        out.push_back(';');
+        AppendInt(out, b);
+    } else {
+        out.append(";5;");
+        AppendInt(out, color);
+    }
+}
+
+// SGR codes to turn each RLUT_TEXT_* mode on and off again
+static const uint8_t sgrModeOn[]  = {0,  1,  2,  3,  4,  5,  7,  8,  9};
+static const uint8_t sgrModeOff[] = {0, 22, 22, 23, 24, 25, 27, 28, 29};
+
+static bool ValidMode(int mode) {
+    return mode > 0 && mode < (int)sizeof(sgrModeOn);
+}
+
+// Emit a single SGR sequence with only the attributes that differ from the
+// terminal's current state
+static void VTSetStyle(VTStream *vt, int8_t mode, uint8_t fg, uint8_t bg) {
+    if (!vt->reset &&
+        fg == vt->foreground &&
+        bg == vt->background &&
+        mode == vt->mode)
+        return;
+    std::string &out = vt->output;
+    out.append("\x1b[");
+    bool first = true;
+    if (vt->reset) {
+        out.push_back('0');
+        vt->mode = vt->foreground = vt->background = -1;
+        vt->reset = first = false;
+    }
+    if (mode != vt->mode) {
+        if (ValidMode(vt->mode)) {
+            if (!first)
+                out.push_back(';');
+            AppendInt(out, sgrModeOff[vt->mode]);
+            first = false;
+        }
+        if (ValidMode(mode)) {
+            if (!first)
+                out.push_back(';');
+            AppendInt(out, sgrModeOn[mode]);
+            first = false;
+        }
+        vt->mode = mode;
+    }
+    if (fg != vt->foreground) {
+        if (!first)
+            out.push_back(';');
+        AppendColor(out, 38, fg);
+        vt->foreground = fg;
+        first = false;
+    }
+    if (bg != vt->background) {
+        if (!first)
+            out.push_back(';');
+        AppendColor(out, 48, bg);
+        vt->background = bg;
+    }
+    out.push_back('m');
+}
+
+static void VTInit(void) {
+    // NCurses still handles the input + terminal modes, it just never gets
+    // anything to draw
+    NcursesInit();
+}
+
+static void VTEncodeSpan(VTStream *vt, const Span *span, const uint64_t *cells) {
+    std::string &out = vt->output;
+    int x = span->x, y = span->y;
+    if (y != vt->y || x != vt->x) {
+        if (y == vt->y && x > vt->x) { // Cursor forward
+            out.append("\x1b[");
+            AppendInt(out, x - vt->x);
+            out.push_back('C');
+        } else { // Cursor position
+            out.append("\x1b[");
+            AppendInt(out, y + 1);
+            out.push_back(';');
+            AppendInt(out, x + 1);
+            out.push_back('H');
+        }
+    }
+    VTSetStyle(vt, span->mode, span->foreground, span->background);
+    bool utf8 = !rlut.hints[RLUT_HINT_DISABLE_UTF8];
+    for (int i = 0; i < span->length; i++) {
+        uint32_t ch = (Cell){.value=cells[i]}.character;
+        // The right half of a 2 column character is drawn with the left half
+        if (ch < 0x80 || !utf8)
+            out.push_back(ch);
+        else if (ch != RLUT_WIDE_CONTINUATION) {
+            char bytes[4];
+            out.append(bytes, EncodeUTF8(ch, bytes));
+        }
+    }
+    vt->x = x + span->length;
+    vt->y = y;
+}
+
+static void VTDrawSpan(const Span *span, const uint64_t *cells) {
+    VTEncodeSpan(&rlut.bands[0].vt, span, cells);
+}
+
+// Each band is encoded into its own stream, starting from an unknown cursor +
+// style as the band before it hasn't been encoded yet
+static void VTDrawBand(int index) {
+    Band *band = &rlut.bands[index];
+    // Reserve enough for a full redraw so the buffer is only grown once
+    band->vt.output.reserve(rlut.screenW * (band->y1 - band->y0) * 16);
+    for (size_t i = 0; i < band->spans.size(); i++) {
+        const Span *span = &band->spans[i];
+        VTEncodeSpan(&band->vt, span, &rlut.backBuffer[span->y * rlut.screenW + span->x]);
+    }
+}
+
+// Set the scroll region (DECSTBM), scroll it up (SU) or down (SD) and reset
+// the region again, which also moves the cursor home
+static void VTScroll(unsigned int top, unsigned int bottom, int n) {
+    VTStream *vt = &rlut.bands[0].vt;
+    std::string &out = vt->output;
+    out.append("\x1b[");
+    AppendInt(out, top + 1);
+    out.push_back(';');
+    AppendInt(out, bottom + 1);
+    out.append("r\x1b[");
+    AppendInt(out, std::abs(n));
+    out.push_back(n > 0 ? 'S' : 'T');
+    out.append("\x1b[r");
+    vt->x = vt->y = -1;
+}
+
+static void VTWrite(const char *data, size_t length) {
+    while (length) {
+        ssize_t n = write(STDOUT_FILENO, data, length);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+// Stitch the bands together in order and write the whole frame with a single
+// write, then forget the cursor + style state in case NCurses touched the
+// terminal before the next frame
+static void VTFlush(void) {
+    std::string &out = rlut.bands[0].vt.output;
+    for (size_t i = 1; i < rlut.bands.size(); i++) {
+        out.append(rlut.bands[i].vt.output);
+        rlut.bands[i].vt.output.clear();
+    }
+    VTWrite(out.data(), out.size());
+    rlut.stats.bytes += out.size();
+    out.clear();
+    for (size_t i = 0; i < rlut.bands.size(); i++) {
+        VTStream *vt = &rlut.bands[i].vt;
+        vt->x = vt->y = -1;
+        vt->reset = true;
+    }
+}
+
+static void VTShutdown(void) {
+    VTWrite("\x1b[0m", 4);
+    NcursesShutdown();
+}
+
+// The headless backend composes frames exactly like the others, but they are
+// only kept in memory to be read back with rlutReadFrame + rlutReadCell
+static void HeadlessInit(void) {
+#if !defined(RLUT_NO_IMGUI)
+    if (rlut.imgui)
+        rlut.tuiScreen = new ImTui::TScreen();
+#endif
+}
+
+static void HeadlessShutdown(void) {
+#if !defined(RLUT_NO_IMGUI)
+    delete rlut.tuiScreen;
+    rlut.tuiScreen = NULL;
+#endif
+}
+
+static void HeadlessScreenSize(unsigned int *width, unsigned int *height) {
+    if (width)
+        *width = std::max(rlut.hints[RLUT_HINT_HEADLESS_COLUMNS], 1);
+    if (height)
+        *height = std::max(rlut.hints[RLUT_HINT_HEADLESS_ROWS], 1);
+}
+
+static void HeadlessNewFrame(void) {
+#if !defined(RLUT_NO_IMGUI)
+    if (!rlut.imgui)
+        return;
+    static Clock::time_point last = Clock::now();
+    Clock::time_point now = Clock::now();
+    float delta = std::chrono::duration<float>(now - last).count();
+    last = now;
+    unsigned int width, height;
+    rlut.backend->screenSize(&width, &height);
+    ImGui::GetIO().DisplaySize = ImVec2(width, height);
+    // ImGui asserts that time moves forward every frame
+    ImGui::GetIO().DeltaTime = std::max(delta, 1e-6f);
+#endif
+}
+
+static void HeadlessDrawSpan(const Span *, const uint64_t *) {}
+static void HeadlessFlush(void) {}
+static void HeadlessWait(void) {}
+static void HeadlessBeep(void) {}
+static int HeadlessInputFd(void) {
+    return -1;
+}
+
+// Pixel backend glyphs are 8x8, bit 0 of each row is the leftmost pixel. Only
+// printable ASCII is included, anything else is drawn as '?'
+#define RLUT_GLYPH_WIDTH 8
+#define RLUT_GLYPH_HEIGHT 8
+#define RLUT_GLYPH_FIRST 0x20
+#define RLUT_GLYPH_COUNT 95
+
+static const uint8_t glyphBitmaps[RLUT_GLYPH_COUNT][RLUT_GLYPH_HEIGHT] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0020 ' '
+    {0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00}, // U+0021 '!'
+    {0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0022 '"'
+    {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00}, // U+0023 '#'
+    {0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00}, // U+0024 '$'
+    {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00}, // U+0025 '%'
+    {0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00}, // U+0026 '&'
+    {0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0027 '''
+    {0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00}, // U+0028 '('
+    {0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00}, // U+0029 ')'
+    {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00}, // U+002A '*'
+    {0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00}, // U+002B '+'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // U+002C ','
+    {0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00}, // U+002D '-'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // U+002E '.'
+    {0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00}, // U+002F '/'
+    {0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00}, // U+0030 '0'
+    {0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00}, // U+0031 '1'
+    {0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00}, // U+0032 '2'
+    {0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00}, // U+0033 '3'
+    {0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00}, // U+0034 '4'
+    {0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00}, // U+0035 '5'
+    {0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00}, // U+0036 '6'
+    {0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00}, // U+0037 '7'
+    {0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00}, // U+0038 '8'
+    {0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00}, // U+0039 '9'
+    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // U+003A ':'
+    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // U+003B ';'
+    {0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00}, // U+003C '<'
+    {0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00}, // U+003D '='
+    {0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00}, // U+003E '>'
+    {0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00}, // U+003F '?'
+    {0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00}, // U+0040 '@'
+    {0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00}, // U+0041 'A'
+    {0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00}, // U+0042 'B'
+    {0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00}, // U+0043 'C'
+    {0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00}, // U+0044 'D'
+    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00}, // U+0045 'E'
+    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00}, // U+0046 'F'
+    {0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00}, // U+0047 'G'
+    {0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00}, // U+0048 'H'
+    {0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+0049 'I'
+    {0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00}, // U+004A 'J'
+    {0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00}, // U+004B 'K'
+    {0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00}, // U+004C 'L'
+    {0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00}, // U+004D 'M'
+    {0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00}, // U+004E 'N'
+    {0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00}, // U+004F 'O'
+    {0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00}, // U+0050 'P'
+    {0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00}, // U+0051 'Q'
+    {0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00}, // U+0052 'R'
+    {0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00}, // U+0053 'S'
+    {0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+0054 'T'
+    {0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00}, // U+0055 'U'
+    {0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // U+0056 'V'
+    {0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00}, // U+0057 'W'
+    {0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00}, // U+0058 'X'
+    {0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00}, // U+0059 'Y'
+    {0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00}, // U+005A 'Z'
+    {0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00}, // U+005B '['
+    {0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00}, // U+005C '\\'
+    {0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00}, // U+005D ']'
+    {0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00}, // U+005E '^'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF}, // U+005F '_'
+    {0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+0060 '`'
+    {0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00}, // U+0061 'a'
+    {0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00}, // U+0062 'b'
+    {0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00}, // U+0063 'c'
+    {0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00}, // U+0064 'd'
+    {0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00}, // U+0065 'e'
+    {0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00}, // U+0066 'f'
+    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // U+0067 'g'
+    {0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00}, // U+0068 'h'
+    {0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+0069 'i'
+    {0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E}, // U+006A 'j'
+    {0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00}, // U+006B 'k'
+    {0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // U+006C 'l'
+    {0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00}, // U+006D 'm'
+    {0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00}, // U+006E 'n'
+    {0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00}, // U+006F 'o'
+    {0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F}, // U+0070 'p'
+    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78}, // U+0071 'q'
+    {0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00}, // U+0072 'r'
+    {0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00}, // U+0073 's'
+    {0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00}, // U+0074 't'
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00}, // U+0075 'u'
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // U+0076 'v'
+    {0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00}, // U+0077 'w'
+    {0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00}, // U+0078 'x'
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // U+0079 'y'
+    {0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00}, // U+007A 'z'
+    {0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00}, // U+007B '{'
+    {0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00}, // U+007C '|'
+    {0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00}, // U+007D '}'
+    {0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // U+007E '~'
+};
+
+// Pack a color in memory order R, G, B, A
+static uint32_t PixelColor(uint8_t r, uint8_t g, uint8_t b) {
+    const uint8_t bytes[4] = {r, g, b, 255};
+    uint32_t result;
+    memcpy(&result, bytes, 4);
+    return result;
+}
+
+static void PixelScreenSize(unsigned int *width, unsigned int *height) {
+    if (width)
+        *width = std::max(rlut.hints[RLUT_HINT_WINDOW_WIDTH] / RLUT_GLYPH_WIDTH, 1);
+    if (height)
+        *height = std::max(rlut.hints[RLUT_HINT_WINDOW_HEIGHT] / RLUT_GLYPH_HEIGHT, 1);
+}
+
+// The font is rasterized once into full pixel masks, so drawing a glyph is a
+// straight select between the foreground + background colors
+static void PixelInit(void) {
+    rlut.pixel.atlas.resize(RLUT_GLYPH_COUNT * RLUT_GLYPH_WIDTH * RLUT_GLYPH_HEIGHT);
+    for (int i = 0; i < RLUT_GLYPH_COUNT; i++)
+        for (int y = 0; y < RLUT_GLYPH_HEIGHT; y++)
+            for (int x = 0; x < RLUT_GLYPH_WIDTH; x++)
+                rlut.pixel.atlas[(i * RLUT_GLYPH_HEIGHT + y) * RLUT_GLYPH_WIDTH + x] = glyphBitmaps[i][y] >> x & 1 ? 0xFFFFFFFF : 0;
+    for (int i = 0; i < 256; i++) {
+        uint8_t r, g, b;
+        PaletteColor(i, &r, &g, &b);
+        rlut.pixel.palette[i] = PixelColor(r, g, b);
+    }
+    rlut.pixel.width = rlut.pixel.height = 0;
+    HeadlessInit();
+#if defined(RLUT_SDL2)
+    unsigned int columns, rows;
+    PixelScreenSize(&columns, &rows);
+    SDL_Init(SDL_INIT_VIDEO);
+    rlut.pixel.window = SDL_CreateWindow("rlut", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                         columns * RLUT_GLYPH_WIDTH, rows * RLUT_GLYPH_HEIGHT, 0);
+    rlut.pixel.renderer = SDL_CreateRenderer(rlut.pixel.window, -1, SDL_RENDERER_SOFTWARE);
+    rlut.pixel.texture = NULL;
+#endif
+}
+
+static void PixelShutdown(void) {
+#if defined(RLUT_SDL2)
+    if (rlut.pixel.texture)
+        SDL_DestroyTexture(rlut.pixel.texture);
+    SDL_DestroyRenderer(rlut.pixel.renderer);
+    SDL_DestroyWindow(rlut.pixel.window);
+    SDL_Quit();
+#endif
+    HeadlessShutdown();
+}
+
+static void PixelNewFrame(void) {
+    unsigned int columns, rows;
+    PixelScreenSize(&columns, &rows);
+    // A new framebuffer is blank, the compositor redraws every cell of the
+    // first frame after a resize so it doesn't need to be cleared
+    if (rlut.pixel.width != columns * RLUT_GLYPH_WIDTH || rlut.pixel.height != rows * RLUT_GLYPH_HEIGHT) {
+        rlut.pixel.width = columns * RLUT_GLYPH_WIDTH;
+        rlut.pixel.height = rows * RLUT_GLYPH_HEIGHT;
+        rlut.pixel.framebuffer.assign(rlut.pixel.width * rlut.pixel.height, rlut.pixel.palette[0]);
+#if defined(RLUT_SDL2)
+        if (rlut.pixel.texture)
+            SDL_DestroyTexture(rlut.pixel.texture);
+        rlut.pixel.texture = SDL_CreateTexture(rlut.pixel.renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING,
+                                               rlut.pixel.width, rlut.pixel.height);
+#endif
+    }
+#if defined(RLUT_SDL2)
+    SDL_Event event;
+    while (SDL_PollEvent(&event))
+        if (event.type == SDL_QUIT)
+            rlutKillLoop();
+#endif
+    HeadlessNewFrame();
+}
+
+// Select between the foreground + background colors of a glyph, `lines` has a
+// bit set for each row that is drawn solid (underline + strikethru)
+static void PixelDrawGlyph(uint32_t *dst, const uint32_t *glyph, uint32_t fg, uint32_t bg, uint8_t lines) {
+#if defined(__SSE2__)
+    const __m128i fgs = _mm_set1_epi32(fg), bgs = _mm_set1_epi32(bg);
+#endif
+    for (int y = 0; y < RLUT_GLYPH_HEIGHT; y++, dst += rlut.pixel.width, glyph += RLUT_GLYPH_WIDTH) {
+        if (lines >> y & 1) {
+            std::fill(dst, dst + RLUT_GLYPH_WIDTH, fg);
+            continue;
+        }
+        int x = 0;
+#if defined(__SSE2__)
+        for (; x + 4 <= RLUT_GLYPH_WIDTH; x += 4) {
+            __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(glyph + x));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x),
+                             _mm_or_si128(_mm_and_si128(mask, fgs), _mm_andnot_si128(mask, bgs)));
+        }
+#endif
+        for (; x < RLUT_GLYPH_WIDTH; x++)
+            dst[x] = (glyph[x] & fg) | (~glyph[x] & bg);
+    }
+}
+
+// Only the cells that changed reach the backend, so only their glyphs are
+// redrawn into the framebuffer
+static void PixelDrawSpan(const Span *span, const uint64_t *cells) {
+    uint8_t fg = span->foreground, bg = span->background, lines = 0;
+    switch (span->mode) {
+        case RLUT_TEXT_BOLD:
+            if (fg < 8)
+                fg += 8;
+            break;
+        case RLUT_TEXT_UNDERLINE:
+            lines = 1 << (RLUT_GLYPH_HEIGHT - 1);
+            break;
+        case RLUT_TEXT_INVERSE:
+            std::swap(fg, bg);
+            break;
+        case RLUT_TEXT_HIDDEN:
+            fg = bg;
+            break;
+        case RLUT_TEXT_STRIKETHRU:
+            lines = 1 << (RLUT_GLYPH_HEIGHT / 2);
+            break;
+    }
+    uint32_t *dst = &rlut.pixel.framebuffer[span->y * RLUT_GLYPH_HEIGHT * rlut.pixel.width + span->x * RLUT_GLYPH_WIDTH];
+    for (int i = 0; i < span->length; i++, dst += RLUT_GLYPH_WIDTH) {
+        uint32_t ch = ((Cell){.value=cells[i]}).character;
+        if (ch < RLUT_GLYPH_FIRST || ch >= RLUT_GLYPH_FIRST + RLUT_GLYPH_COUNT)
+            ch = ch && ch != RLUT_WIDE_CONTINUATION ? '?' : ' ';
+        const uint32_t *glyph = &rlut.pixel.atlas[(ch - RLUT_GLYPH_FIRST) * RLUT_GLYPH_WIDTH * RLUT_GLYPH_HEIGHT];
+        PixelDrawGlyph(dst, glyph, rlut.pixel.palette[fg], rlut.pixel.palette[bg], lines);
+    }
+}
+
+// Bands cover separate rows of the framebuffer so they can be drawn at once
+static void PixelDrawBand(int index) {
+    const Band *band = &rlut.bands[index];
+    for (size_t i = 0; i < band->spans.size(); i++) {
+        const Span *span = &band->spans[i];
+        PixelDrawSpan(span, &rlut.backBuffer[span->y * rlut.screenW + span->x]);
+    }
+}
+
+static void PixelScroll(unsigned int top, unsigned int bottom, int n) {
+    size_t row = rlut.pixel.width * RLUT_GLYPH_HEIGHT;
+    unsigned int count = bottom - top + 1, shift = std::abs(n);
+    uint32_t *pixels = &rlut.pixel.framebuffer[top * row];
+    if (shift < count)
+        memmove(n > 0 ? pixels : pixels + shift * row,
+                n > 0 ? pixels + shift * row : pixels,
+                (count - shift) * row * sizeof(uint32_t));
+}
+
+static void PixelFlush(void) {
+#if defined(RLUT_SDL2)
+    if (!rlut.pixel.texture)
+        return;
+    SDL_UpdateTexture(rlut.pixel.texture, NULL, rlut.pixel.framebuffer.data(), rlut.pixel.width * sizeof(uint32_t));
+    SDL_RenderCopy(rlut.pixel.renderer, rlut.pixel.texture, NULL, NULL);
+    SDL_RenderPresent(rlut.pixel.renderer);
+#endif
+}
+
+static void PixelWait(void) {
+#if defined(RLUT_SDL2)
+    WaitFrame();
+#endif
+}
+
+static const Backend backends[] = {
+    { // RLUT_BACKEND_NCURSES
+        NcursesInit, NcursesShutdown, NcursesScreenSize, NcursesNewFrame,
+        NcursesDrawSpan, NULL, NcursesScroll, NcursesFlush, NcursesWait, NcursesBeep,
+        NcursesInputFd
+    },
+    { // RLUT_BACKEND_VT
+        VTInit, VTShutdown, NcursesScreenSize, NcursesNewFrame,
+        VTDrawSpan, VTDrawBand, VTScroll, VTFlush, NcursesWait, NcursesBeep,
+        NcursesInputFd
+    },
+    { // RLUT_BACKEND_HEADLESS
+        HeadlessInit, HeadlessShutdown, HeadlessScreenSize, HeadlessNewFrame,
+        HeadlessDrawSpan, NULL, NULL, HeadlessFlush, HeadlessWait, HeadlessBeep,
+        HeadlessInputFd
+    },
+    { // RLUT_BACKEND_PIXEL
+        PixelInit, PixelShutdown, PixelScreenSize, PixelNewFrame,
+        PixelDrawSpan, PixelDrawBand, PixelScroll, PixelFlush, PixelWait, HeadlessBeep,
+        HeadlessInputFd
+    }
+};
+
+static const Backend* FindBackend(int backend) {
+    if (backend < 0 || backend >= (int)(sizeof(backends) / sizeof(backends[0])))
+        return NULL;
+    return &backends[backend];
+}
+
+// Hand the spans built by ComposeFrame to the backend, a band at a time on
+// each band's thread if the backend can
+static void PresentFrame(void) {
+    for (size_t i = 0; i < rlut.scrolls.size(); i++)
+        rlut.backend->scrollRows(rlut.scrolls[i].top, rlut.scrolls[i].bottom, rlut.scrolls[i].n);
+    rlut.scrolls.clear();
+    bool bands = rlut.backend->drawBand != NULL;
+    if (bands)
+        RunBands(rlut.backend->drawBand);
+    for (size_t i = 0; i < rlut.spans.size(); i++) {
+        const Span *span = &rlut.spans[i];
+        if (!bands)
+            rlut.backend->drawSpan(span, &rlut.backBuffer[span->y * rlut.screenW + span->x]);
+        rlut.stats.cells += span->length;
+        if (i && (span->foreground != span[-1].foreground || span->background != span[-1].background))
+            rlut.stats.pairSwitches++;
+    }
+    rlut.backend->flush();
+}
+
+void rlutTimerFunc(unsigned int msecs, void(*func)(int value), int value) {
+    Timer timer;
+    timer.when = Clock::now() + std::chrono::milliseconds(msecs);
+    timer.func = func;
+    timer.value = value;
+    // Keep timers sorted by when they are due, timers due at the same time
+    // are called in the order they were added
+    std::vector<Timer>::iterator it = rlut.timers.begin();
+    while (it != rlut.timers.end() && it->when <= timer.when)
+        it++;
+    rlut.timers.insert(it, timer);
+    if (rlut.events.wakeup[1] != -1)
+        rlutPostRedisplay();
+}
+
+// Call any timers that are due. Timers can add more timers, so each one is
+// removed before it's called
+static void RunTimers(void) {
+    Clock::time_point now = Clock::now();
+    while (!rlut.timers.empty() && rlut.timers.front().when <= now) {
+        Timer timer = rlut.timers.front();
+        rlut.timers.erase(rlut.timers.begin());
+        timer.func(timer.value);
+    }
+}
+
+// Safe to call from any thread
+void rlutPostRedisplay(void) {
+    rlut.events.dirty = true;
+    if (rlut.events.wakeup[1] == -1)
+        return;
+#if defined(__linux__)
+    uint64_t one = 1;
+    ssize_t n = write(rlut.events.wakeup[1], &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t n = write(rlut.events.wakeup[1], &one, sizeof(one));
+#endif
+    (void)n;
+}
+
+static void DrainFd(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+// The wakeup fd lets other threads + signals interrupt the event loop, an
+// eventfd on Linux or a self-pipe elsewhere. Linux also gets a timerfd so
+// deadlines aren't rounded to poll's milliseconds
+static void InitEvents(void) {
+#if defined(__linux__)
+    rlut.events.wakeup[0] = rlut.events.wakeup[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    rlut.events.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#else
+    if (pipe(rlut.events.wakeup) == 0)
+        for (int i = 0; i < 2; i++) {
+            fcntl(rlut.events.wakeup[i], F_SETFL, fcntl(rlut.events.wakeup[i], F_GETFL) | O_NONBLOCK);
+            fcntl(rlut.events.wakeup[i], F_SETFD, FD_CLOEXEC);
+        }
+    else
+        rlut.events.wakeup[0] = rlut.events.wakeup[1] = -1;
+#endif
+    rlut.events.lastFrame = Clock::now();
+}
+
+static void ShutdownEvents(void) {
+    if (rlut.events.wakeup[0] != -1)
+        close(rlut.events.wakeup[0]);
+    if (rlut.events.wakeup[1] != rlut.events.wakeup[0])
+        close(rlut.events.wakeup[1]);
+    if (rlut.events.timer != -1)
+        close(rlut.events.timer);
+    rlut.events.wakeup[0] = rlut.events.wakeup[1] = rlut.events.timer = -1;
+}
+
+// Block until there is a reason to run another frame: input, a timer firing
+// or the screen being marked dirty. Frames are still capped to the frame rate
+static void WaitForEvents(void) {
+    Clock::time_point nextFrame = rlut.events.lastFrame + FrameInterval();
+    for (;;) {
+        RunTimers();
+        Clock::time_point now = Clock::now();
+        bool pending = rlut.events.dirty || rlut.events.activeFrames > 0 || !rlut.running;
+        if (pending && now >= nextFrame)
+            break;
+        // Sleep until the next timer or, if a frame is pending, the next frame
+        bool hasDeadline = pending || !rlut.timers.empty();
+        Clock::time_point deadline = pending ? nextFrame : Clock::time_point::max();
+        if (!rlut.timers.empty())
+            deadline = std::min(deadline, rlut.timers.front().when);
+        int timeout = -1;
+#if defined(__linux__)
+        if (rlut.events.timer != -1) {
+            struct itimerspec spec = {};
+            if (hasDeadline) {
+                long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count();
+                ns = std::max(ns, 1LL);
+                spec.it_value.tv_sec = ns / 1000000000LL;
+                spec.it_value.tv_nsec = ns % 1000000000LL;
+            }
+            timerfd_settime(rlut.events.timer, 0, &spec, NULL);
+        } else
+#endif
+        if (hasDeadline)
+            timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()) + 1;
+        struct pollfd fds[3];
+        int n = 0, input = -1;
+        // Input is only read once the frame runs, with a frame already pending
+        // it would wake poll straight away until then
+        if (rlut.backend->inputFd() != -1 && !pending) {
+            input = n;
+            fds[n].fd = rlut.backend->inputFd();
+            fds[n++].events = POLLIN;
+        }
+        if (rlut.events.wakeup[0] != -1) {
+            fds[n].fd = rlut.events.wakeup[0];
+            fds[n++].events = POLLIN;
+        }
+        if (rlut.events.timer != -1) {
+            fds[n].fd = rlut.events.timer;
+            fds[n++].events = POLLIN;
+        }
+        int result = poll(fds, n, timeout);
+        if (result < 0) {
+            // Interrupted by a signal, most likely a resize
+            if (errno == EINTR)
+                rlut.events.dirty = true;
+            continue;
+        }
+        for (int i = 0; i < n; i++)
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (i == input) // Give ImGui a few frames to react to input
+                    rlut.events.activeFrames = rlut.imgui ? 10 : 1;
+                else
+                    DrainFd(fds[i].fd);
+            }
+    }
+    // Pick up input that came in while the frame was pending
+    if (rlut.backend->inputFd() != -1 && rlut.events.activeFrames <= 1) {
+        struct pollfd fd = {rlut.backend->inputFd(), POLLIN, 0};
+        if (poll(&fd, 1, 0) > 0 && (fd.revents & (POLLIN | POLLHUP | POLLERR)))
+            rlut.events.activeFrames = rlut.imgui ? 10 : 1;
+    }
+    rlut.events.dirty = false;
+    if (rlut.events.activeFrames > 0)
+        rlut.events.activeFrames--;
+}
+
+// Recordings start with RLUT_RECORDING_MAGIC, followed by a record for every
+// frame: a type byte, the columns + rows (u16) and the payload length (u32),
+// all little endian. A payload is a list of changed runs, each one is the
+// number of unchanged cells to skip + the length of the run (varints) and then
+// the run itself as pairs of repeat count (varint) + cell (u64). Keyframes are
+// encoded against a blank screen so they can be decoded on their own
+#define RLUT_RECORDING_MAGIC "RLUTREC1"
+#define RLUT_RECORDING_HEADER 9
+
+enum {
+    RLUT_RECORD_DELTA = 0,
+    RLUT_RECORD_KEYFRAME
+};
+
+static void AppendVarint(std::vector<uint8_t> &out, uint32_t value) {
+    for (; value >= 0x80; value >>= 7)
+        out.push_back((value & 0x7F) | 0x80);
+    out.push_back(value);
+}
+
+static bool ReadVarint(const uint8_t **p, const uint8_t *end, uint32_t *value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 35; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static void AppendLE(std::vector<uint8_t> &out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out.push_back(value >> (i * 8));
+}
+
+static uint64_t ReadLE(const uint8_t *p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (uint64_t)p[i] << (i * 8);
+    return value;
+}
+
+// Encode the cells that differ from `previous` as changed runs of RLE cells
+static void EncodeFrame(std::vector<uint8_t> &out, const uint64_t *previous, const uint64_t *cells, int count) {
+    int x = 0, end = 0;
+    while ((x = FirstDifference(cells, previous, x, count)) < count) {
+        int start = x;
+        while (x < count && cells[x] != previous[x])
+            x++;
+        AppendVarint(out, start - end);
+        AppendVarint(out, x - start);
+        for (int i = start; i < x;) {
+            int j = i + 1;
+            while (j < x && cells[j] == cells[i])
+                j++;
+            AppendVarint(out, j - i);
+            AppendLE(out, cells[i], 8);
+            i = j;
+        }
+        end = x;
+    }
+}
+
+static bool DecodeFrame(const uint8_t *p, const uint8_t *end, uint64_t *cells, uint32_t count) {
+    uint32_t x = 0, skip, length, repeat;
+    while (p < end) {
+        if (!ReadVarint(&p, end, &skip) || !ReadVarint(&p, end, &length) ||
+            skip > count - x || length > count - x - skip)
+            return false;
+        x += skip;
+        for (uint32_t runEnd = x + length; x < runEnd;) {
+            if (!ReadVarint(&p, end, &repeat) || end - p < 8 || !repeat || repeat > runEnd - x)
+                return false;
+            std::fill(cells + x, cells + x + repeat, ReadLE(p, 8));
+            p += 8;
+            x += repeat;
+        }
+    }
+    return true;
+}
+
+static void RecorderThread(void) {
+    Recorder *rec = &rlut.recorder;
+    std::vector<uint8_t> buffer;
+    std::unique_lock<std::mutex> lock(rec->lock);
+    for (;;) {
+        rec->wake.wait(lock, [rec] { return rec->stop || !rec->encoded.empty(); });
+        if (rec->encoded.empty() && rec->stop)
+            break;
+        buffer.swap(rec->encoded);
+        lock.unlock();
+        fwrite(buffer.data(), 1, buffer.size(), rec->file);
+        fflush(rec->file);
+        buffer.clear();
+        lock.lock();
+    }
+}
+
+int rlutStartRecording(const char *path) {
+    Recorder *rec = &rlut.recorder;
+    rlutStopRecording();
+    // Each recording is a file of its own, an existing file is replaced
+    if (!(rec->file = fopen(path, "wb")))
+        return 0;
+    fwrite(RLUT_RECORDING_MAGIC, 1, strlen(RLUT_RECORDING_MAGIC), rec->file);
+    rec->frame = 0;
+    rec->stop = false;
+    rec->writer = std::thread(RecorderThread);
+    return 1;
+}
+
+void rlutStopRecording(void) {
+    Recorder *rec = &rlut.recorder;
+    if (!rec->file)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(rec->lock);
+        rec->stop = true;
+    }
+    rec->wake.notify_one();
+    rec->writer.join();
+    fclose(rec->file);
+    rec->file = NULL;
+    rec->previous.clear();
+}
+
+// Add the composed frame to the recording, a keyframe is written every
+// RLUT_HINT_RECORD_KEYFRAME_INTERVAL frames or when the screen is resized
+static void RecordFrame(void) {
+    Recorder *rec = &rlut.recorder;
+    int interval = std::max(rlut.hints[RLUT_HINT_RECORD_KEYFRAME_INTERVAL], 1);
+    int count = rlut.screenW * rlut.screenH;
+    uint8_t type = RLUT_RECORD_DELTA;
+    if (rec->frame++ % interval == 0 || rec->columns != rlut.screenW || rec->rows != rlut.screenH) {
+        type = RLUT_RECORD_KEYFRAME;
+        rec->previous.assign(count, 0);
+        rec->columns = rlut.screenW;
+        rec->rows = rlut.screenH;
+        rec->frame = 1;
+    }
+    std::lock_guard<std::mutex> lock(rec->lock);
+    std::vector<uint8_t> &out = rec->encoded;
+    size_t header = out.size();
+    out.push_back(type);
+    AppendLE(out, rec->columns, 2);
+    AppendLE(out, rec->rows, 2);
+    AppendLE(out, 0, 4);
+    EncodeFrame(out, rec->previous.data(), rlut.backBuffer.data(), count);
+    uint32_t length = out.size() - header - RLUT_RECORDING_HEADER;
+    for (int i = 0; i < 4; i++)
+        out[header + 5 + i] = length >> (i * 8);
+    rec->previous = rlut.backBuffer;
+    rec->wake.notify_one();
+}
+
+struct rlutRecording {
+    FILE *file;
+    std::vector<std::pair<unsigned int, long>> keyframes; // Frame + file offset
+    unsigned int frames, frame;
+    unsigned int columns, rows;
+    long offset; // Offset of the next frame
+    std::vector<uint64_t> cells;
+    std::vector<uint8_t> payload;
+};
+
+// Decode the frame at the current offset of the recording
+static bool ReadRecordingFrame(rlutRecording *rec) {
+    uint8_t header[RLUT_RECORDING_HEADER];
+    if (fseek(rec->file, rec->offset, SEEK_SET) ||
+        fread(header, 1, RLUT_RECORDING_HEADER, rec->file) != RLUT_RECORDING_HEADER)
+        return false;
+    unsigned int columns = ReadLE(header + 1, 2), rows = ReadLE(header + 3, 2);
+    rec->payload.resize(ReadLE(header + 5, 4));
+    if (fread(rec->payload.data(), 1, rec->payload.size(), rec->file) != rec->payload.size())
+        return false;
+    if (header[0] == RLUT_RECORD_KEYFRAME) {
+        rec->columns = columns;
+        rec->rows = rows;
+        rec->cells.assign(columns * rows, 0);
+    } else if (columns != rec->columns || rows != rec->rows)
+        return false;
+    if (!DecodeFrame(rec->payload.data(), rec->payload.data() + rec->payload.size(), rec->cells.data(), rec->cells.size()))
+        return false;
+    rec->offset += RLUT_RECORDING_HEADER + rec->payload.size();
+    return true;
+}
+
+// Open a recording + index its keyframes, frames can then be stepped through
+// with rlutNextRecordingFrame or jumped to with rlutSeekRecording
+rlutRecording* rlutOpenRecording(const char *path) {
+    FILE *fh = fopen(path, "rb");
+    if (!fh)
+        return NULL;
+    char magic[8];
+    if (fread(magic, 1, 8, fh) != 8 || memcmp(magic, RLUT_RECORDING_MAGIC, 8) || fseek(fh, 0, SEEK_END)) {
+        fclose(fh);
+        return NULL;
+    }
+    long size = ftell(fh), offset = 8;
+    rlutRecording *rec = new rlutRecording;
+    rec->file = fh;
+    rec->frames = 0;
+    uint8_t header[RLUT_RECORDING_HEADER];
+    // A partially written frame at the end of the file is ignored
+    while (!fseek(fh, offset, SEEK_SET) && fread(header, 1, RLUT_RECORDING_HEADER, fh) == RLUT_RECORDING_HEADER) {
+        long next = offset + RLUT_RECORDING_HEADER + (long)ReadLE(header + 5, 4);
+        if (next > size || (header[0] != RLUT_RECORD_KEYFRAME && rec->keyframes.empty()))
+            break;
+        if (header[0] == RLUT_RECORD_KEYFRAME)
+            rec->keyframes.push_back(std::make_pair(rec->frames, offset));
+        rec->frames++;
+        offset = next;
+    }
+    rec->frame = 0;
+    if (!rec->keyframes.empty()) {
+        rec->offset = rec->keyframes[0].second;
+        if (ReadRecordingFrame(rec))
+            return rec;
+    }
+    rlutCloseRecording(rec);
+    return NULL;
+}
+
+void rlutCloseRecording(rlutRecording *rec) {
+    if (!rec)
+        return;
+    fclose(rec->file);
+    delete rec;
+}
+
+void rlutRecordingInfo(rlutRecording *rec, unsigned int *columns, unsigned int *rows, unsigned int *frames, unsigned int *frame) {
+    if (columns)
+        *columns = rec->columns;
+    if (rows)
+        *rows = rec->rows;
+    if (frames)
+        *frames = rec->frames;
+    if (frame)
+        *frame = rec->frame;
+}
+
+int rlutNextRecordingFrame(rlutRecording *rec) {
+    if (rec->frame + 1 >= rec->frames || !ReadRecordingFrame(rec))
+        return 0;
+    rec->frame++;
+    return 1;
+}
+
+// Jump to the closest keyframe at or before `frame` and decode forward from
+// it, unless the current frame is already past that keyframe
+int rlutSeekRecording(rlutRecording *rec, unsigned int frame) {
+    if (frame >= rec->frames)
+        return 0;
+    std::vector<std::pair<unsigned int, long>>::const_iterator keyframe =
+        std::upper_bound(rec->keyframes.begin(), rec->keyframes.end(), std::make_pair(frame, LONG_MAX)) - 1;
+    if (rec->frame > frame || keyframe->first > rec->frame) {
+        rec->offset = keyframe->second;
+        if (!ReadRecordingFrame(rec))
+            return 0;
+        rec->frame = keyframe->first;
+    }
+    while (rec->frame < frame)
+        if (!rlutNextRecordingFrame(rec))
+            return 0;
+    return 1;
+}
+
+// The current frame as packed cells (see RLUT_CELL), `columns` * `rows` long
+const uint64_t* rlutRecordingCells(rlutRecording *rec) {
+    return rec->cells.data();
+}
+
+static inline void EndPhase(int phase) {
+    Clock::time_point now = Clock::now();
+    rlut.stats.samples[phase][rlut.stats.next] = std::chrono::duration_cast<std::chrono::nanoseconds>(now - rlut.stats.phaseStart).count();
+    rlut.stats.phaseStart = now;
+}
+
+static void EndFrameStats(void) {
+    FrameStats *stats = &rlut.stats;
+    stats->phaseStart = stats->frameStart;
+    EndPhase(RLUT_PHASE_FRAME);
+    stats->lastBytes = stats->bytes;
+    stats->lastCells = stats->cells;
+    stats->lastPairSwitches = stats->pairSwitches;
+    stats->totalBytes += stats->bytes;
+    stats->totalCells += stats->cells;
+    stats->totalPairSwitches += stats->pairSwitches;
+    stats->bytes = stats->cells = stats->pairSwitches = 0;
+    stats->next = (stats->next + 1) % RLUT_STATS_WINDOW;
+    stats->count = std::min(stats->count + 1, (unsigned int)RLUT_STATS_WINDOW);
+}
+
+void rlutGetFrameStats(rlutFrameStats *result) {
+    const FrameStats *stats = &rlut.stats;
+    std::array<uint64_t, RLUT_STATS_WINDOW> sorted;
+    for (int i = 0; i < RLUT_PHASE_COUNT; i++) {
+        rlutPhaseStats *phase = &result->phases[i];
+        if (!stats->count) {
+            phase->min = phase->avg = phase->p99 = 0.f;
+            continue;
+        }
+        std::copy(stats->samples[i].begin(), stats->samples[i].begin() + stats->count, sorted.begin());
+        uint64_t sum = 0;
+        for (unsigned int j = 0; j < stats->count; j++)
+            sum += sorted[j];
+        std::nth_element(sorted.begin(), sorted.begin() + (stats->count - 1) * 99 / 100, sorted.begin() + stats->count);
+        phase->p99 = sorted[(stats->count - 1) * 99 / 100] / 1e6f;
+        phase->min = *std::min_element(sorted.begin(), sorted.begin() + stats->count) / 1e6f;
+        phase->avg = sum / (double)stats->count / 1e6;
+    }
+    result->frames = stats->count;
+    result->bytesWritten = stats->lastBytes;
+    result->cellsChanged = stats->lastCells;
+    result->pairSwitches = stats->lastPairSwitches;
+    result->totalBytesWritten = stats->totalBytes;
+    result->totalCellsChanged = stats->totalCells;
+    result->totalPairSwitches = stats->totalPairSwitches;
+}
+
+#define RLUT_STATS_OVERLAY_WIDTH 64
+
+// Draw the frame stats into a panel in the top right corner of the screen
+static void DrawStatsOverlay(void) {
+    FrameStats *stats = &rlut.stats;
+    if (!rlut.hints[RLUT_HINT_SHOW_FRAME_STATS]) {
+        rlutDestroyPanel(stats->overlay);
+        stats->overlay = NULL;
+        return;
+    }
+    unsigned int width = std::min(rlut.screenW, (unsigned int)RLUT_STATS_OVERLAY_WIDTH);
+    if (!stats->overlay)
+        stats->overlay = rlutCreatePanel(rlut.screenW - width, 0, width, 1);
+    rlutMovePanel(stats->overlay, rlut.screenW - width, 0);
+    rlutFrameStats frame;
+    rlutGetFrameStats(&frame);
+    char line[RLUT_STATS_OVERLAY_WIDTH + 1];
+    snprintf(line, sizeof(line), "%6.2fms p99 %6.2f | disp %5.2f cmp %5.2f out %5.2f | %5u",
+             frame.phases[RLUT_PHASE_FRAME].avg - frame.phases[RLUT_PHASE_WAIT].avg,
+             frame.phases[RLUT_PHASE_FRAME].p99,
+             frame.phases[RLUT_PHASE_DISPLAY].avg,
+             frame.phases[RLUT_PHASE_COMPOSE].avg,
+             frame.phases[RLUT_PHASE_OUTPUT].avg,
+             (unsigned int)frame.cellsChanged);
+    rlutPanelBegin(stats->overlay);
+    rlutSetCursor(0, 0);
+    for (unsigned int i = 0; i < width; i++)
+        rlutPrintChar(line[i] ? line[i] : ' ', RLUT_TEXT_INVERSE, 15, 0);
+    rlutPanelEnd();
+    // Don't count the overlay towards the next phase
+    stats->phaseStart = Clock::now();
+}
+
+// A panel that was left open has its size swapped in for the screen's, it has
+// to be ended before the screen is resized or composed
+static void EndOpenPanel(void) {
+    assert(!rlut.panel && "rlutPanelBegin without rlutPanelEnd");
+    rlutPanelEnd();
+}
+
+static void RunFrame(void) {
+    rlut.stats.frameStart = rlut.stats.phaseStart = Clock::now();
+    RunTimers();
+    rlut.events.lastFrame = Clock::now();
+    rlut.backend->newFrame();
+    EndPhase(RLUT_PHASE_INPUT);
+#if !defined(RLUT_NO_IMGUI)
+    if (rlut.imgui) {
+        ImTui_ImplText_NewFrame();
+        ImGui::NewFrame();
+    }
+#endif
+    EndPhase(RLUT_PHASE_IMGUI);
+    
+    EndOpenPanel();
+    ResizeScreenBuffer();
+    
+    if (rlut.preframeFunc)
+        rlut.preframeFunc();
+    
+    rlut.displayFunc();
+    EndOpenPanel();
+    ApplyCommandBuffers();
+    EndPhase(RLUT_PHASE_DISPLAY);
+    DrawStatsOverlay();
+    
+#if !defined(RLUT_NO_IMGUI)
+    if (rlut.imgui) {
+        ImGui::Render();
+        ImTui_ImplText_RenderDrawData(ImGui::GetDrawData(), rlut.tuiScreen);
+    }
+#endif
+    EndPhase(RLUT_PHASE_RENDER);
+    
+    ComposeFrame();
+    if (rlut.recorder.file)
+        RecordFrame();
+    EndPhase(RLUT_PHASE_COMPOSE);
+    PresentFrame();
+    EndPhase(RLUT_PHASE_OUTPUT);
+    
+    if (rlut.running) {
+        if (rlut.hints[RLUT_HINT_ENABLE_EVENT_LOOP])
+            WaitForEvents();
+        else
+            rlut.backend->wait();
+    }
+    EndPhase(RLUT_PHASE_WAIT);
+    EndFrameStats();
+}
+
+static void Shutdown(void) {
+    if (rlut.postframeFunc)
+        rlut.postframeFunc();
+    
+    if (rlut.atExitFunc)
+        rlut.atExitFunc();
+#if !defined(RLUT_NO_IMGUI)
+    if (rlut.imgui)
+        ImTui_ImplText_Shutdown();
+#endif
+    rlut.backend->shutdown();
+    rlut.backend = NULL;
+    StopBandPool();
+    ShutdownEvents();
+    rlutStopRecording();
+    ClearLayouts();
+    ClearCommandBuffers();
+}
+
+// Run a single frame, returns 0 once the loop has been killed and everything
+// has been shut down
+int rlutMainLoopEvent(void) {
+    assert(rlut.displayFunc && rlut.backend);
+    if (rlut.running)
+        RunFrame();
+    if (rlut.running)
+        return 1;
+    Shutdown();
+    return 0;
+}
+
+int rlutMainLoop(void) {
+    rlut.running = true;
+    while (rlutMainLoopEvent());
+    return 0;
+}
+
+static void ClearScreenBuffer(void) {
+    if (!rlut.panel)
+        ResizeLayer(&rlut.layers[rlut.layer]);
+    CellBufferFill(Target(), 0, 0, rlut.screenW, rlut.screenH, DefaultCellValue());
+    MarkDirty(0, 0, rlut.screenW, rlut.screenH);
+    rlut.cursorX = rlut.cursorY = 0;
+}
+
+void rlutClearScreen(void) {
+    ClearScreenBuffer();
+}
+
+// Scroll rows `top` to `bottom` of the layer or panel being drawn to by `n`
+// rows, up when positive. Scrolling a layer scrolls the terminal too, so only
+// the rows that scroll into view have to be drawn
+void rlutScrollRegion(unsigned int top, unsigned int bottom, int n) {
+    if (!rlut.panel)
+        ResizeLayer(&rlut.layers[rlut.layer]);
+    CellBuffer *buf = Target();
+    if (!buf->h || !n)
+        return;
+    bottom = std::min(bottom, buf->h - 1);
+    if (top > bottom)
+        return;
+    int count = bottom - top + 1;
+    n = std::max(-count, std::min(n, count));
+    CellBufferScroll(buf, top, bottom, n, DefaultCellValue());
+    MarkDirty(0, top, buf->w, count);
+    // Terminals ignore scroll regions of a single row, and scrolling a region
+    // all the way out is no cheaper than drawing it, just redraw those rows
+    if (!rlut.panel && count >= 2 && std::abs(n) < count) {
+        Scroll scroll;
+        scroll.top = top;
+        scroll.bottom = bottom;
+        scroll.n = n;
+        rlut.scrolls.push_back(scroll);
+    }
+}
+
+// Select the layer that is drawn to, layers are created the first time they're
+// selected. Layer 0 is the base layer that every other layer is drawn over
+void rlutLayer(unsigned int layer) {
+    if (layer >= RLUT_MAX_LAYERS)
+        return;
+    rlut.layer = layer;
+    // Layers that were skipped over are flattened too, so they need cells
+    for (unsigned int i = rlut.layerCount; i < layer; i++)
+        ResizeLayer(&rlut.layers[i]);
+    if (layer >= rlut.layerCount)
+        rlut.layerCount = layer + 1;
+    ResizeLayer(&rlut.layers[layer]);
+}
+
+void rlutLayerMode(unsigned int layer, int mode) {
+    if (layer >= RLUT_MAX_LAYERS || rlut.layers[layer].mode == mode)
+        return;
+    rlut.layers[layer].mode = mode;
+    if (layer < rlut.layerCount)
+        DirtyRegionMark(&rlut.layers[layer].dirty, 0, 0, rlut.screenW, rlut.screenH);
+}
+
+static void SwapDrawState(DrawState *state) {
+    std::swap(state->w, rlut.screenW);
+    std::swap(state->h, rlut.screenH);
+    std::swap(state->cursorX, rlut.cursorX);
+    std::swap(state->cursorY, rlut.cursorY);
+    std::swap(state->savedCursorX, rlut.savedCursorX);
+    std::swap(state->savedCursorY, rlut.savedCursorY);
+    std::swap(state->textMode, rlut.textMode);
+    std::swap(state->backgroundColor, rlut.backgroundColor);
+    std::swap(state->foregroundColor, rlut.foregroundColor);
+}
+
+rlutPanel* rlutCreatePanel(int x, int y, unsigned int w, unsigned int h) {
+    if (!w || !h)
+        return NULL;
+    rlutPanel *panel = new rlutPanel;
+    panel->x = x;
+    panel->y = y;
+    panel->state = (DrawState) {
+        .w = w,
+        .h = h,
+        .cursorX = 0,
+        .cursorY = 0,
+        .savedCursorX = 0,
+        .savedCursorY = 0,
+        .textMode = 0,
+        .backgroundColor = static_cast<uint8_t>(rlut.hints[RLUT_HINT_DEFAULT_BACKGROUND_COLOR]),
+        .foregroundColor = static_cast<uint8_t>(rlut.hints[RLUT_HINT_DEFAULT_FOREGROUND_COLOR])
+    };
+    CellBufferResize(&panel->cells, w, h, DefaultCellValue());
+    DirtyRegionResize(&panel->dirty, h);
+    DirtyRegionMark(&panel->dirty, 0, 0, w, h);
+    rlut.panels.push_back(panel);
+    return panel;
+}
+
+void rlutDestroyPanel(rlutPanel *panel) {
+    if (!panel)
+        return;
+    if (rlut.panel == panel)
+        rlutPanelEnd();
+    rlut.panels.erase(std::remove(rlut.panels.begin(), rlut.panels.end(), panel), rlut.panels.end());
+    DamageScreenRect(panel->x, panel->y, panel->cells.w, panel->cells.h);
+    CellBufferFree(&panel->cells);
+    delete panel;
+}
+
+void rlutMovePanel(rlutPanel *panel, int x, int y) {
+    if (!panel || (panel->x == x && panel->y == y))
+        return;
+    DamageScreenRect(panel->x, panel->y, panel->cells.w, panel->cells.h);
+    panel->x = x;
+    panel->y = y;
+    DamageScreenRect(panel->x, panel->y, panel->cells.w, panel->cells.h);
+}
+
+// Every draw function writes to the panel until rlutPanelEnd is called, the
+// panel's cursor + text style are swapped in for the screen's
+void rlutPanelBegin(rlutPanel *panel) {
+    if (rlut.panel)
+        rlutPanelEnd();
+    if (!panel)
+        return;
+    rlut.panel = panel;
+    SwapDrawState(&panel->state);
+}
+
+void rlutPanelEnd(void) {
+    if (!rlut.panel)
+        return;
+    SwapDrawState(&rlut.panel->state);
+    rlut.panel = NULL;
 }
 
 void rlutMoveCursor(int x, int y) {
@@ -352,12 +3184,12 @@ void rlutMoveCursor(int x, int y) {
             else // No wrapping needed
                 rlut.cursorY = dy;
         } else
-            rlut.cursorY = CLAMP(dy, 0, rlut.screenH - 1);
+            rlut.cursorY = CLAMP(dy, 0, (int)rlut.screenH - 1);
     }
     if (x != 0) {
         int dx = rlut.cursorX + x;
         if (rlut.hints[RLUT_HINT_DISABLE_TEXT_WRAP])
-            rlut.cursorX = CLAMP(dx, 0, rlut.screenW - 1);
+            rlut.cursorX = CLAMP(dx, 0, (int)rlut.screenW - 1);
         else {
             if (dx < 0) {
                 // Underflow, wrap backwards to previous line unless on first line
@@ -390,12 +3222,7 @@ void rlutSetCursor(unsigned int x, unsigned int y) {
 }
 
 void rlutScreenSize(unsigned int *width, unsigned int *height) {
-    unsigned int col, row;
-    getmaxyx(stdscr, row, col);
-    if (width)
-        *width = col;
-    if (height)
-        *height = row;
+    rlut.backend->screenSize(width, height);
 }
 
 void rlutCursorPosition(unsigned int *x, unsigned int *y) {
@@ -405,341 +3232,1221 @@ void rlutCursorPosition(unsigned int *x, unsigned int *y) {
         *y = rlut.cursorY;
 }
 
-void rlutPrintChar(uint32_t ch, int8_t mode, uint8_t fg, uint8_t bg) {
+// Print a character at the cursor. 2 column characters also fill the cell to
+// their right, when there is no room left on the line they wrap to the next
+// line like a terminal would or are printed as a space
+static void PrintCell(uint32_t ch, int8_t mode, uint8_t fg, uint8_t bg, bool advance) {
+    int width = 1;
+    if (!rlut.hints[RLUT_HINT_DISABLE_UTF8] && CharWidth(ch) == 2) {
+        if (rlut.cursorX + 1 >= rlut.screenW && advance &&
+            !rlut.hints[RLUT_HINT_DISABLE_TEXT_WRAP] && rlut.cursorY != rlut.screenH - 1)
+            PrintCell(' ', mode, fg, bg, true);
+        if (rlut.cursorX + 1 < rlut.screenW)
+            width = 2;
+        else
+            ch = ' ';
+    }
     assert(rlut.cursorX >= 0 && rlut.cursorY >= 0 && rlut.cursorX < rlut.screenW && rlut.cursorY < rlut.screenH);
+    CellBuffer *target = Target();
     Cell cell = {
         .character = ch,
+        .mode = mode,
         .foreground = fg,
         .background = bg,
-        .mode = mode,
         .used = 1
     };
-    rlut.screenBuffer[rlut.cursorY][rlut.cursorX] = cell.value;
-    if (!rlut.hints[RLUT_HINT_DISABLE_TEXT_AUTO_ADVANCE])
-        rlutMoveCursor(+1, 0);
+    CellBufferSet(target, rlut.cursorX, rlut.cursorY, cell);
+    if (width == 2) {
+        cell.character = RLUT_WIDE_CONTINUATION;
+        CellBufferSet(target, rlut.cursorX + 1, rlut.cursorY, cell);
+    }
+    MarkDirty(rlut.cursorX, rlut.cursorY, width, 1);
+    if (advance)
+        rlutMoveCursor(width, 0);
 }
 
-// Attempt to read the next token in the ANSI escape sequence
-static bool ParseNextANSIEscapeToken(char *p, bool *isInteger, uint8_t *value, size_t *length) {
-    // Check if unexpected eol
-    if (!p || !*p)
-        return false;
-    bool isInt = true;
-    int i = 0;
-    char buf[3] = {0};
-    switch (*p) {
-        // First character is a number, attempt to read up to 3 digits (0-255)
-        case '0' ... '9': {
-            for (; i < 3; i++) {
-                char c = *(p + i);
-                if (c < '0' || c > '9') {
-                    if (c == ';' ||
-                        (c >= 'a' && c <= 'z') ||
-                        (c >= 'A' && c <= 'Z'))
-                        break;
-                    else
-                        return false; // error, invalid integer
-                }
-                // Valid integer, store in buffer
-                buf[i] = c;
-            }
-            break;
-        }
-        // Not a number, could be the mode
-        case 'a' ... 'z':
-        case 'A' ... 'Z':
-            buf[0] = *p;
-            i = 1;
-            isInt = false;
-            break;
-        // Not a-z, A-Z or 0-9 (invalid)
-        default:
-            return false; // error, invalid character
-    }
-    // Return token length, if it's an integer and the token value
-    if (length)
-        *length = i;
-    if (isInteger)
-        *isInteger = isInt;
-    if (value) {
-        if (isInt) {
-            int v = std::stoi(std::string(buf));
-            // Values must be be 0-255
-            if (v < 0 || v > UINT8_MAX)
-                return false;
-            *value = static_cast<uint8_t>(v);
-        } else
-            *value = *(char*)&buf;
-    }
+void rlutPrintChar(uint32_t ch, int8_t mode, uint8_t fg, uint8_t bg) {
+    PrintCell(ch, mode, fg, bg, !rlut.hints[RLUT_HINT_DISABLE_TEXT_AUTO_ADVANCE]);
+}
+
+// Clip a rectangle to the screen, returns false if nothing is left. The
+// offsets are how far into the source the clipped rectangle starts
+static bool ClipRect(int *x, int *y, unsigned int *w, unsigned int *h, unsigned int *offsetX, unsigned int *offsetY) {
+    *offsetX = *x < 0 ? -*x : 0;
+    *offsetY = *y < 0 ? -*y : 0;
+    if (*offsetX >= *w || *offsetY >= *h)
+        return false;
+    *x += *offsetX;
+    *y += *offsetY;
+    if (*x >= (int)rlut.screenW || *y >= (int)rlut.screenH)
+        return false;
+    *w = std::min(*w - *offsetX, rlut.screenW - *x);
+    *h = std::min(*h - *offsetY, rlut.screenH - *y);
     return true;
 }
 
+void rlutBlit(const uint32_t *characters, const uint8_t *fg, const uint8_t *bg, unsigned int w, unsigned int h, unsigned int stride, int x, int y) {
+    unsigned int ox, oy;
+    if (!characters || !ClipRect(&x, &y, &w, &h, &ox, &oy))
+        return;
+    size_t offset = oy * stride + ox;
+    MarkDirty(x, y, w, h);
+    CellBufferBlitPlanes(Target(), x, y, w, h,
+                         characters + offset, fg ? fg + offset : NULL, bg ? bg + offset : NULL, stride,
+                         rlut.textMode, rlut.foregroundColor, rlut.backgroundColor);
+}
+
+void rlutBlitCells(const uint64_t *cells, unsigned int w, unsigned int h, unsigned int stride, int x, int y) {
+    unsigned int ox, oy;
+    if (!cells || !ClipRect(&x, &y, &w, &h, &ox, &oy))
+        return;
+    MarkDirty(x, y, w, h);
+    CellBufferBlit(Target(), x, y, w, h, cells + oy * stride + ox, stride);
+}
+
 static void ClearLineToEnd(void) {
-    for (int x = rlut.cursorX; x < rlut.screenW - 1; x++)
-        rlut.screenBuffer[rlut.cursorY][x] = 0;
+    CellBufferFill(Target(), rlut.cursorX, rlut.cursorY, rlut.screenW - rlut.cursorX, 1, 0);
+    MarkDirty(rlut.cursorX, rlut.cursorY, rlut.screenW - rlut.cursorX, 1);
 }
 
 static void ClearLineToCursor(void) {
-    for (int x = 0; x < rlut.cursorX; x++)
-        rlut.screenBuffer[rlut.cursorY][x] = 0;
+    CellBufferFill(Target(), 0, rlut.cursorY, rlut.cursorX + 1, 1, 0);
+    MarkDirty(0, rlut.cursorY, rlut.cursorX + 1, 1);
 }
 
 static void ClearLine(int y) {
-    std::fill(rlut.screenBuffer[y].begin(), rlut.screenBuffer[y].end(), 0);
+    CellBufferFill(Target(), 0, y, rlut.screenW, 1, 0);
+    MarkDirty(0, y, rlut.screenW, 1);
 }
 
 static void ResetTextStyle(void) {
     rlut.textMode = 0;
     rlut.backgroundColor = rlut.hints[RLUT_HINT_DEFAULT_BACKGROUND_COLOR];
     rlut.foregroundColor = rlut.hints[RLUT_HINT_DEFAULT_FOREGROUND_COLOR];
-    Cell currentCell = (Cell){.value=rlut.screenBuffer[rlut.cursorY][rlut.cursorX]};
-    currentCell.background = rlut.backgroundColor;
-    currentCell.foreground = rlut.backgroundColor;
-    currentCell.used = 1;
-    rlut.screenBuffer[rlut.cursorY][rlut.cursorX] = currentCell.value;
 }
 
+// SGR colors 1-7 are RLUT's brighter versions of them, see RLUT_COLOR_*
 static int ToAnsiColor(int n) {
-    switch (n){
-        default:
-        case 0:
-            return n;
-        case 1 ... 8:
-            return n + 8;
-        case 9:
-            return rlut.hints[RLUT_HINT_DEFAULT_BACKGROUND_COLOR];
+    return n ? n + 8 : n;
+}
+
+// Parser states, character classes + actions of the escape sequence state
+// machine. It's a cut down version of the DEC VT500 parser, OSC, DCS, SOS,
+// PM + APC strings are all skipped the same way
+enum {
+    RLUT_ANSI_GROUND = 0,
+    RLUT_ANSI_ESCAPE,
+    RLUT_ANSI_ESCAPE_INTERMEDIATE,
+    RLUT_ANSI_CSI_ENTRY,
+    RLUT_ANSI_CSI_PARAM,
+    RLUT_ANSI_CSI_INTERMEDIATE,
+    RLUT_ANSI_CSI_IGNORE,
+    RLUT_ANSI_STRING,
+    RLUT_ANSI_STATES
+};
+
+enum {
+    RLUT_BYTE_CONTROL = 0,
+    RLUT_BYTE_BEL,
+    RLUT_BYTE_CANCEL, // CAN + SUB
+    RLUT_BYTE_ESC,
+    RLUT_BYTE_INTERMEDIATE, // 0x20-0x2F
+    RLUT_BYTE_DIGIT,
+    RLUT_BYTE_COLON,
+    RLUT_BYTE_SEMICOLON,
+    RLUT_BYTE_MARKER, // < = > ?
+    RLUT_BYTE_CSI, // [
+    RLUT_BYTE_STRING, // ] P X ^ _
+    RLUT_BYTE_FINAL, // The rest of 0x40-0x7E
+    RLUT_BYTE_DEL,
+    RLUT_BYTE_HIGH, // UTF-8
+    RLUT_BYTE_CLASSES
+};
+
+enum {
+    RLUT_ACTION_NONE = 0,
+    RLUT_ACTION_EXECUTE,
+    RLUT_ACTION_PRINT,
+    RLUT_ACTION_CLEAR,
+    RLUT_ACTION_COLLECT,
+    RLUT_ACTION_PARAM,
+    RLUT_ACTION_ESC_DISPATCH,
+    RLUT_ACTION_CSI_DISPATCH
+};
+
+static std::array<uint8_t, 256> AnsiClasses(void) {
+    std::array<uint8_t, 256> classes;
+    for (int c = 0; c < 256; c++)
+        classes[c] = c >= 0x80 ? RLUT_BYTE_HIGH :
+                     c == 0x7F ? RLUT_BYTE_DEL :
+                     c >= 0x40 ? RLUT_BYTE_FINAL :
+                     c >= 0x3C ? RLUT_BYTE_MARKER :
+                     c >= 0x30 ? RLUT_BYTE_DIGIT :
+                     c >= 0x20 ? RLUT_BYTE_INTERMEDIATE : RLUT_BYTE_CONTROL;
+    classes['\a'] = RLUT_BYTE_BEL;
+    classes[0x18] = classes[0x1A] = RLUT_BYTE_CANCEL;
+    classes[0x1B] = RLUT_BYTE_ESC;
+    classes[':'] = RLUT_BYTE_COLON;
+    classes[';'] = RLUT_BYTE_SEMICOLON;
+    classes['['] = RLUT_BYTE_CSI;
+    classes[']'] = classes['P'] = classes['X'] = classes['^'] = classes['_'] = RLUT_BYTE_STRING;
+    return classes;
+}
+
+static const std::array<uint8_t, 256> ansiClasses = AnsiClasses();
+
+// The action to run + the next state for each state + character class
+#define T(ACTION, STATE) (RLUT_ACTION_##ACTION << 4 | RLUT_ANSI_##STATE)
+static const uint8_t ansiTransitions[RLUT_ANSI_STATES][RLUT_BYTE_CLASSES] = {
+    // CONTROL, BEL, CANCEL, ESC, INTERMEDIATE, DIGIT, COLON, SEMICOLON, MARKER, CSI, STRING, FINAL, DEL, HIGH
+    { // Ground
+        T(EXECUTE, GROUND), T(EXECUTE, GROUND), T(NONE, GROUND), T(CLEAR, ESCAPE),
+        T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND),
+        T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND), T(NONE, GROUND), T(PRINT, GROUND)
+    },
+    { // Escape
+        T(EXECUTE, ESCAPE), T(EXECUTE, ESCAPE), T(NONE, GROUND), T(CLEAR, ESCAPE),
+        T(COLLECT, ESCAPE_INTERMEDIATE), T(ESC_DISPATCH, GROUND), T(ESC_DISPATCH, GROUND), T(ESC_DISPATCH, GROUND), T(ESC_DISPATCH, GROUND),
+        T(CLEAR, CSI_ENTRY), T(NONE, STRING), T(ESC_DISPATCH, GROUND), T(NONE, ESCAPE), T(NONE, GROUND)
+    },
+    { // Escape intermediate
+        T(EXECUTE, ESCAPE_INTERMEDIATE), T(EXECUTE, ESCAPE_INTERMEDIATE), T(NONE, GROUND), T(CLEAR, ESCAPE),
+        T(COLLECT, ESCAPE_INTERMEDIATE), T(ESC_DISPATCH, GROUND), T(ESC_DISPATCH, GROUND), T(ESC_DISPATCH, GROUND), T(ESC_DISPATCH, GROUND),
+        T(ESC_DISPATCH, GROUND), T(ESC_DISPATCH, GROUND), T(ESC_DISPATCH, GROUND), T(NONE, ESCAPE_INTERMEDIATE), T(NONE, GROUND)
+    },
+    { // CSI entry
+        T(EXECUTE, CSI_ENTRY), T(EXECUTE, CSI_ENTRY), T(NONE, GROUND), T(CLEAR, ESCAPE),
+        T(COLLECT, CSI_INTERMEDIATE), T(PARAM, CSI_PARAM), T(NONE, CSI_IGNORE), T(PARAM, CSI_PARAM), T(COLLECT, CSI_PARAM),
+        T(CSI_DISPATCH, GROUND), T(CSI_DISPATCH, GROUND), T(CSI_DISPATCH, GROUND), T(NONE, CSI_ENTRY), T(NONE, GROUND)
+    },
+    { // CSI parameters
+        T(EXECUTE, CSI_PARAM), T(EXECUTE, CSI_PARAM), T(NONE, GROUND), T(CLEAR, ESCAPE),
+        T(COLLECT, CSI_INTERMEDIATE), T(PARAM, CSI_PARAM), T(NONE, CSI_IGNORE), T(PARAM, CSI_PARAM), T(NONE, CSI_IGNORE),
+        T(CSI_DISPATCH, GROUND), T(CSI_DISPATCH, GROUND), T(CSI_DISPATCH, GROUND), T(NONE, CSI_PARAM), T(NONE, GROUND)
+    },
+    { // CSI intermediate
+        T(EXECUTE, CSI_INTERMEDIATE), T(EXECUTE, CSI_INTERMEDIATE), T(NONE, GROUND), T(CLEAR, ESCAPE),
+        T(COLLECT, CSI_INTERMEDIATE), T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE),
+        T(CSI_DISPATCH, GROUND), T(CSI_DISPATCH, GROUND), T(CSI_DISPATCH, GROUND), T(NONE, CSI_INTERMEDIATE), T(NONE, GROUND)
+    },
+    { // CSI ignore, malformed sequences are skipped up to their final byte
+        T(EXECUTE, CSI_IGNORE), T(EXECUTE, CSI_IGNORE), T(NONE, GROUND), T(CLEAR, ESCAPE),
+        T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE),
+        T(NONE, GROUND), T(NONE, GROUND), T(NONE, GROUND), T(NONE, CSI_IGNORE), T(NONE, GROUND)
+    },
+    { // Strings, skipped up to BEL or ST (ESC \)
+        T(NONE, STRING), T(NONE, GROUND), T(NONE, GROUND), T(CLEAR, ESCAPE),
+        T(NONE, STRING), T(NONE, STRING), T(NONE, STRING), T(NONE, STRING), T(NONE, STRING),
+        T(NONE, STRING), T(NONE, STRING), T(NONE, STRING), T(NONE, STRING), T(NONE, STRING)
+    }
+};
+#undef T
+
+// Add a digit or separator to the parameters, numbers are capped instead of
+// overflowing + parameters past the last one kept are dropped
+static void PushParam(AnsiParser *parser, uint8_t c) {
+    if (!parser->count)
+        parser->count = 1;
+    if (c == ';') {
+        if (++parser->count <= RLUT_ANSI_MAX_PARAMS)
+            parser->params[parser->count - 1] = 0;
+        return;
+    }
+    if (parser->count <= RLUT_ANSI_MAX_PARAMS) {
+        uint16_t *param = &parser->params[parser->count - 1];
+        *param = std::min(*param * 10 + (c - '0'), (int)UINT16_MAX);
     }
 }
 
-// Attempt to parse an ANSI escape sequence
-static char* ParseANSIEscape(char *_p) {
-    // Check if the first character is not null and = '['
-    if (!_p || !*_p || *_p != '[')
-        return _p;
-    char *p = (char*)++_p;
-    int n = 0;
-    // Store values in this buffer, maximum of 4 tokens, the mode and up to 3 integer values
-    uint8_t tmp[4] = {0};
-    // Keeps track if the current token is an integer value or the mode, if it's the mode
-    // start to evaluate with the integer values (if any)
-    bool isInteger;
-    // Keep track of how far we have read into the string
-    size_t totalLength = 0, tokenLength = 0;
-    while (n < 4 && ParseNextANSIEscapeToken(p, &isInteger, &tmp[n], &tokenLength)) {
-        totalLength += tokenLength;
-        // If the token is an integer, check for a semi-colon delimeter and skip to
-        // the next token
-        if (isInteger) {
-            p += tokenLength;
-            char next = *p;
-            if ((next < 'a' && next > 'z') &&
-                (next < 'A' && next > 'Z') &&
-                next != ';') // error, expecting semi-colon delimeter
-                return _p;
-            if (next == ';') {
-                p++;
-                totalLength++;
-            }
-            n++;
-            continue; // next token
-        }
-        
-        // The token isn't an integer, check if it's a valid mode
-        switch (tmp[n]) {
-            case 'A': // Move cursor up
-                rlutMoveCursor(0, -1 * (n ? tmp[0] : 1));
+// Parameters that are missing or 0 are replaced with `fallback`
+static unsigned int Param(const AnsiParser *parser, unsigned int i, unsigned int fallback) {
+    return i < std::min(parser->count, (unsigned int)RLUT_ANSI_MAX_PARAMS) && parser->params[i] ? parser->params[i] : fallback;
+}
+
+// Read the color of a 38 or 48 SGR parameter, either 5;index or 2;r;g;b.
+// Moves `i` to the last parameter of the color, returns -1 if it's malformed
+static int ExtendedColor(const AnsiParser *parser, unsigned int *i, unsigned int count) {
+    const uint16_t *params = parser->params;
+    if (*i + 2 < count && params[*i + 1] == 5) {
+        *i += 2;
+        return std::min(params[*i], (uint16_t)UINT8_MAX);
+    }
+    if (*i + 4 < count && params[*i + 1] == 2) {
+        *i += 4;
+        return NearestPaletteColor(std::min(params[*i - 2], (uint16_t)UINT8_MAX),
+                                   std::min(params[*i - 1], (uint16_t)UINT8_MAX),
+                                   std::min(params[*i], (uint16_t)UINT8_MAX));
+    }
+    return -1;
+}
+
+static void SelectGraphicRendition(const AnsiParser *parser) {
+    unsigned int count = std::min(parser->count, (unsigned int)RLUT_ANSI_MAX_PARAMS);
+    if (!count)
+        ResetTextStyle();
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int n = parser->params[i];
+        switch (n) {
+            case 0:
+                ResetTextStyle();
                 break;
-            case 'B': // Move cursor down
-                rlutMoveCursor(0, +1 * (n ? tmp[0] : 1));
+            case 1 ... 9: // Text modes, rapid blinking is just blinking
+                for (int mode = 1; mode < (int)sizeof(sgrModeOn); mode++)
+                    if (sgrModeOn[mode] == (n == 6 ? 5 : n))
+                        rlut.textMode = mode;
                 break;
-            case 'C': // Move cursor forward
-                rlutMoveCursor(+1 * (n ? tmp[0] : 1), 0);
+            case 22 ... 29: // Text modes off
+                if (ValidMode(rlut.textMode) && sgrModeOff[rlut.textMode] == n)
+                    rlut.textMode = 0;
                 break;
-            case 'D': // Move cursor back
-                rlutMoveCursor(-1 * (n ? tmp[0] : 1), 0);
+            case 30 ... 37:
+                rlut.foregroundColor = ToAnsiColor(n - 30);
                 break;
-            case 'E': { // Cursor next line
-                int dy = rlut.cursorY + 1 * (n ? tmp[0] : 1);
-                int mh = rlut.screenH - 1;
-                rlut.cursorY = std::max(dy, mh);
-                rlut.cursorX = 0;
+            case 38:
+            case 48: {
+                int color = ExtendedColor(parser, &i, count);
+                if (color < 0)
+                    return; // The parameters after it can't be trusted
+                if (n == 38)
+                    rlut.foregroundColor = color;
+                else
+                    rlut.backgroundColor = color;
                 break;
             }
-            case 'F': { // Cursor previous line
-                int dy = rlut.cursorY + -1 * (n ? tmp[0] : 1);
-                rlut.cursorY = std::max(dy, 0);
-                rlut.cursorX = 0;
+            case 39:
+                rlut.foregroundColor = rlut.hints[RLUT_HINT_DEFAULT_FOREGROUND_COLOR];
                 break;
-            }
-            case 'G': // Cursor horizontal absolute
-                rlutSetCursor(n ? tmp[0] : 0, rlut.cursorY);
+            case 40 ... 47:
+                rlut.backgroundColor = ToAnsiColor(n - 40);
                 break;
-            case 'H': // Cursor position
-                switch (n) {
-                    case 0:
-                        rlutSetCursor(0, 0);
-                        break;
-                    case 1:
-                        rlutSetCursor(tmp[0], rlut.cursorY);
-                        break;
-                    default:
-                    case 2:
-                        rlutSetCursor(tmp[0], tmp[1]);
-                        break;
-                }
+            case 49:
+                rlut.backgroundColor = rlut.hints[RLUT_HINT_DEFAULT_BACKGROUND_COLOR];
                 break;
-            case 'J': { // Erase in Display
-                int mode = 0;
-                switch (n) {
-                    default:
-                    case 1:
-                        mode = tmp[0];
-                    case 0:
-                        switch (mode) {
-                            case 0: // Clear cursor to end of screen
-                                ClearLineToEnd();
-                                for (int y = rlut.cursorY; y < rlut.screenH - 1; y++)
-                                    ClearLine(y);
-                                break;
-                            case 1: // Clear from cursor to beginning of screen
-                                ClearLineToCursor();
-                                for (int y = 0; y < rlut.cursorY; y++)
-                                    ClearLine(y);
-                                break;
-                            case 3: // Same as 2, but deletes scrollback buffer (we have no scrollback buffer)
-                            case 2: // Clear entire screen and move cursor to 0,0
-                                rlutClearScreen();
-                                rlutSetCursor(0, 0);
-                                break;
-                            default: // error, invalid mode
-                                return _p;
-                        }
-                        break;
-                }
+            case 90 ... 97: // Bright colors
+                rlut.foregroundColor = n - 90 + 8;
+                break;
+            case 100 ... 107:
+                rlut.backgroundColor = n - 100 + 8;
                 break;
+            default: // Unsupported, skip
+                break;
+        }
+    }
+}
+
+static void DispatchCSI(const AnsiParser *parser, uint8_t final) {
+    // Private sequences are terminal modes, there's nothing to apply them to
+    if (parser->marker || parser->intermediate)
+        return;
+    unsigned int n = Param(parser, 0, 1);
+    switch (final) {
+        case 'A': // Move cursor up
+            rlut.cursorY -= std::min(n, rlut.cursorY);
+            break;
+        case 'B': // Move cursor down
+            rlut.cursorY = std::min(rlut.cursorY + n, rlut.screenH - 1);
+            break;
+        case 'C': // Move cursor forward
+            rlut.cursorX = std::min(rlut.cursorX + n, rlut.screenW - 1);
+            break;
+        case 'D': // Move cursor back
+            rlut.cursorX -= std::min(n, rlut.cursorX);
+            break;
+        case 'E': // Cursor next line
+            rlut.cursorY = std::min(rlut.cursorY + n, rlut.screenH - 1);
+            rlut.cursorX = 0;
+            break;
+        case 'F': // Cursor previous line
+            rlut.cursorY -= std::min(n, rlut.cursorY);
+            rlut.cursorX = 0;
+            break;
+        case 'G': // Cursor horizontal absolute
+        case '`':
+            rlutSetCursor(n - 1, rlut.cursorY);
+            break;
+        case 'd': // Cursor vertical absolute
+            rlutSetCursor(rlut.cursorX, n - 1);
+            break;
+        case 'H': // Cursor position, row then column
+        case 'f':
+            rlutSetCursor(Param(parser, 1, 1) - 1, n - 1);
+            break;
+        case 'J': // Erase in Display
+            switch (Param(parser, 0, 0)) {
+                case 0: // Clear cursor to end of screen
+                    ClearLineToEnd();
+                    for (unsigned int y = rlut.cursorY + 1; y < rlut.screenH; y++)
+                        ClearLine(y);
+                    break;
+                case 1: // Clear from cursor to beginning of screen
+                    ClearLineToCursor();
+                    for (unsigned int y = 0; y < rlut.cursorY; y++)
+                        ClearLine(y);
+                    break;
+                case 3: // Same as 2, but deletes scrollback buffer (we have no scrollback buffer)
+                case 2: // Clear entire screen and move cursor to 0,0
+                    rlutClearScreen();
+                    rlutSetCursor(0, 0);
+                    break;
+            }
+            break;
+        case 'K': // Erase in Line
+            switch (Param(parser, 0, 0)) {
+                case 0: // clear from cursor to eol
+                    ClearLineToEnd();
+                    break;
+                case 1: // clear from cursor to start of line
+                    ClearLineToCursor();
+                    break;
+                case 2: // clear the entire line
+                    ClearLine(rlut.cursorY);
+                    break;
             }
-            case 'K': { // Erase in Line
-                int mode = 0;
-                switch (n) {
-                    default:
-                    case 1:
-                        mode = tmp[0];
-                    case 0:
-                        switch (mode) {
-                            case 0: // clear from cursor to eol
-                                ClearLineToEnd();
-                                break;
-                            case 1: // clear from cursor to start of line
-                                ClearLineToCursor();
-                                break;
-                            case 2: // clear the entire line
-                                ClearLine(rlut.cursorY);
-                                break;
-                            default: // error, invalid mode
-                                return _p;
-                        }
-                        break;
+            break;
+        case 'S': // Scroll up
+            rlutScrollRegion(0, rlut.screenH - 1, n);
+            break;
+        case 'T': // Scroll down
+            rlutScrollRegion(0, rlut.screenH - 1, -(int)n);
+            break;
+        case 'm': // Select Graphic Rendition
+            SelectGraphicRendition(parser);
+            break;
+        case 's': // Save Current Cursor Position
+            rlut.savedCursorX = rlut.cursorX;
+            rlut.savedCursorY = rlut.cursorY;
+            break;
+        case 'u': // Restore Saved Cursor Position
+            rlut.cursorX = rlut.savedCursorX;
+            rlut.cursorY = rlut.savedCursorY;
+            break;
+        default: // Unsupported, skip
+            break;
+    }
+}
+
+static void DispatchEscape(const AnsiParser *parser, uint8_t final) {
+    if (parser->intermediate)
+        return;
+    switch (final) {
+        case '7': // Save Cursor
+            rlut.savedCursorX = rlut.cursorX;
+            rlut.savedCursorY = rlut.cursorY;
+            break;
+        case '8': // Restore Cursor
+            rlut.cursorX = rlut.savedCursorX;
+            rlut.cursorY = rlut.savedCursorY;
+            break;
+    }
+}
+
+static void ExecuteControl(uint8_t c) {
+    switch (c) {
+        case '\a': // Bell
+            rlutBeep();
+            break;
+        case '\b': // Backspace
+            rlutMoveCursor(-1, 0);
+            break;
+        case '\n': // Line Feed
+            rlut.cursorX = 0;
+        case '\f':
+        case '\v': // Form feed + Vertical tab
+            if (rlut.cursorY != rlut.screenH - 1)
+                rlut.cursorY++;
+            break;
+        case '\r': // Carriage Return
+            rlut.cursorX = 0;
+            break;
+        case '\t': // Tab
+            if (rlut.cursorX == rlut.screenW - 1) {
+                if (rlut.cursorY != rlut.screenH - 1) {
+                    rlut.cursorY++;
+                    rlut.cursorX = 0;
                 }
-                break;
+            } else
+                rlut.cursorX = std::min((rlut.cursorX + 8) & ~7, rlut.screenW - 1);
+            break;
+    }
+}
+
+// Count the printable ASCII characters at the start of a string, they're the
+// only characters that can be copied straight into the cells
+static size_t ASCIIRun(const char *p, const char *end) {
+    const char *start = p;
+#if defined(__SSE2__)
+    // Signed compares, anything past 0x7F is negative + fails the first
+    const __m128i low = _mm_set1_epi8(0x1F), high = _mm_set1_epi8(0x7F);
+    for (; end - p >= 16; p += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int printable = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(bytes, low), _mm_cmplt_epi8(bytes, high)));
+        if (printable != 0xFFFF)
+            return p - start + __builtin_ctz(~printable);
+    }
+#endif
+    while (p < end && (uint8_t)*p >= 0x20 && (uint8_t)*p < 0x7F)
+        p++;
+    return p - start;
+}
+
+// Print a run of printable ASCII characters. Everything up to the last column
+// is copied in at once, the cursor only has to wrap on the last column
+static void PrintASCIIRun(const char *p, size_t length) {
+    uint32_t characters[256];
+    while (length) {
+        size_t fit = std::min(std::min(length, sizeof(characters) / sizeof(characters[0])),
+                              (size_t)(rlut.screenW - 1 - rlut.cursorX));
+        if (!fit) {
+            PrintCell(*p++, rlut.textMode, rlut.foregroundColor, rlut.backgroundColor, true);
+            length--;
+            continue;
+        }
+        for (size_t i = 0; i < fit; i++)
+            characters[i] = (uint8_t)p[i];
+        CellBufferBlitPlanes(Target(), rlut.cursorX, rlut.cursorY, fit, 1, characters, NULL, NULL, fit,
+                             rlut.textMode, rlut.foregroundColor, rlut.backgroundColor);
+        MarkDirty(rlut.cursorX, rlut.cursorY, fit, 1);
+        rlut.cursorX += fit;
+        p += fit;
+        length -= fit;
+    }
+}
+
+// Print the character at the start of a string. A UTF-8 character cut off by
+// the end of the string is held back until the next print finishes it
+static const char* PrintCharacter(AnsiParser *parser, const char *p, const char *end) {
+    uint32_t ch = (uint8_t)*p;
+    if (rlut.hints[RLUT_HINT_DISABLE_UTF8]) {
+        PrintCell(ch, rlut.textMode, rlut.foregroundColor, rlut.backgroundColor, true);
+        return p + 1;
+    }
+    if (UTF8Length(ch) > end - p) {
+        const char *q = p + 1;
+        while (q < end && ((uint8_t)*q & 0xC0) == 0x80)
+            q++;
+        if (q == end) {
+            memcpy(parser->utf8, p, end - p);
+            parser->utf8Length = end - p;
+            return end;
+        }
+    }
+    p += DecodeUTF8(p, end, &ch);
+    PrintCell(ch, rlut.textMode, rlut.foregroundColor, rlut.backgroundColor, true);
+    return p;
+}
+
+// Finish the character held back by the last print. If it was cut short
+// by anything else, the bytes held back are printed as they are
+static const char* FinishCharacter(AnsiParser *parser, const char *p, const char *end) {
+    unsigned int length = UTF8Length(parser->utf8[0]);
+    while (parser->utf8Length < length && p < end && ((uint8_t)*p & 0xC0) == 0x80)
+        parser->utf8[parser->utf8Length++] = *p++;
+    if (parser->utf8Length < length && p == end)
+        return p;
+    for (const char *q = parser->utf8, *qend = q + parser->utf8Length; q < qend;) {
+        uint32_t ch;
+        q += DecodeUTF8(q, qend, &ch);
+        PrintCell(ch, rlut.textMode, rlut.foregroundColor, rlut.backgroundColor, true);
+    }
+    parser->utf8Length = 0;
+    return p;
+}
+
+// Print a string of `length` bytes, parsing any ANSI escapes and control codes.
+// Characters are decoded from UTF-8 unless RLUT_HINT_DISABLE_UTF8 is set
+static void PrintText(const char *p, size_t length) {
+    AnsiParser *parser = &rlut.ansi;
+    const char *end = p + length;
+    if (parser->utf8Length)
+        p = FinishCharacter(parser, p, end);
+    while (p < end) {
+        // Printable ASCII goes straight to the cells, everything else is run
+        // through the state machine
+        if (parser->state == RLUT_ANSI_GROUND) {
+            size_t run = ASCIIRun(p, end);
+            if (run) {
+                PrintASCIIRun(p, run);
+                p += run;
+                continue;
             }
-            case 'm': // Select Graphic Rendition
-                if (!n)
-                    ResetTextStyle();
+        }
+        uint8_t c = *p;
+        uint8_t transition = ansiTransitions[parser->state][ansiClasses[c]];
+        parser->state = transition & 0x0F;
+        switch (transition >> 4) {
+            case RLUT_ACTION_PRINT:
+                p = PrintCharacter(parser, p, end);
+                continue;
+            case RLUT_ACTION_EXECUTE:
+                ExecuteControl(c);
+                break;
+            case RLUT_ACTION_CLEAR:
+                parser->count = 0;
+                parser->params[0] = 0;
+                parser->marker = parser->intermediate = 0;
+                break;
+            case RLUT_ACTION_COLLECT:
+                if (c >= 0x3C)
+                    parser->marker = c;
                 else
-                    for (int i = 0; i < std::min(n, 4); i++)
-                        switch (tmp[i]) {
-                            case 0 ... 9: // Text modes
-                                if (!(rlut.textMode = ToAnsiColor(tmp[i])))
-                                    ResetTextStyle();
-                                break;
-                            case 30 ... 39: // Foreground colors
-                                if (tmp[i] == 38)
-                                    return _p; // Invalid
-                                rlut.foregroundColor = ToAnsiColor(tmp[i] - 30);
-                                break;
-                            case 40 ... 49: // Background colors
-                                if (tmp[i] == 48)
-                                    return _p; // Invalid
-                                rlut.backgroundColor = ToAnsiColor(tmp[i] - 40);
-                                break;
-                            default: // Unsupported, skip
-                                return _p;
-                        }
+                    parser->intermediate = c;
                 break;
-            case 'n': // Device Status Report
-            case 's': // Save Current Cursor Position
-                rlut.savedCursorX = rlut.cursorX;
-                rlut.savedCursorY = rlut.cursorY;
+            case RLUT_ACTION_PARAM:
+                PushParam(parser, c);
                 break;
-            case 'u': // Restore Saved Cursor Position
-                rlut.cursorX = rlut.savedCursorX;
-                rlut.cursorY = rlut.savedCursorY;
+            case RLUT_ACTION_ESC_DISPATCH:
+                DispatchEscape(parser, c);
+                break;
+            case RLUT_ACTION_CSI_DISPATCH:
+                DispatchCSI(parser, c);
                 break;
-            default: // error, invalid mode
-                return _p;
         }
-        // Valid mode, break out of loop and return adjusted pointer
-        break;
+        p++;
     }
-    // The -1 is because after returning the string, the original loop will
-    // increment by an extra character, so just trim it off here instead
-    return _p + (totalLength - 1);
+}
+
+// Most strings fit in a buffer on the stack, only strings too long for it are
+// formatted a second time into a heap buffer. Returns `buffer` or the heap
+// buffer the caller has to free, NULL if formatting failed
+static char* FormatString(char *buffer, size_t size, int *length, const char *fmt, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    *length = vsnprintf(buffer, size, fmt, copy);
+    va_end(copy);
+    if (*length < 0)
+        return NULL;
+    if (*length < (int)size)
+        return buffer;
+    char *heap = static_cast<char*>(RLUT_MALLOC(*length + 1));
+    if (heap)
+        vsnprintf(heap, *length + 1, fmt, args);
+    return heap;
+}
+
+void rlutPrintStringV(const char *fmt, va_list args) {
+    char buffer[256];
+    int length;
+    char *str = FormatString(buffer, sizeof(buffer), &length, fmt, args);
+    if (!str)
+        return;
+    PrintText(str, length);
+    if (str != buffer)
+        RLUT_FREE(str);
 }
 
 void rlutPrintString(const char *fmt, ...) {
-    // Format a string into a string buffer
+    // Nothing to format, print the string as it is
+    if (!strchr(fmt, '%')) {
+        PrintText(fmt, strlen(fmt));
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    rlutPrintStringV(fmt, args);
+    va_end(args);
+}
+
+void rlutPrintStringN(const char *str, size_t length) {
+    PrintText(str, length);
+}
+
+// Print a string into an offscreen panel as big as the string could take up
+static void PrintCanvas(rlutPanel *canvas, const char *str, size_t length) {
+    // A byte moves the cursor 2 columns at most (wide characters) or 8 for a
+    // tab, cursor movement escapes are clamped to this size
+    unsigned int w = 1, h = 1, column = 0;
+    for (size_t i = 0; i < length; i++)
+        switch (str[i]) {
+            case '\n':
+            case '\v':
+            case '\f':
+                h++;
+                column = 0;
+                break;
+            default:
+                column += str[i] == '\t' ? 8 : 2;
+                w = std::max(w, column);
+                break;
+        }
+    canvas->state = (DrawState) {
+        .w = std::min(w, (unsigned int)UINT16_MAX),
+        .h = std::min(h, (unsigned int)UINT16_MAX),
+        .cursorX = 0,
+        .cursorY = 0,
+        .savedCursorX = 0,
+        .savedCursorY = 0,
+        .textMode = rlut.textMode,
+        .backgroundColor = rlut.backgroundColor,
+        .foregroundColor = rlut.foregroundColor
+    };
+    CellBufferResize(&canvas->cells, canvas->state.w, canvas->state.h, 0);
+    DirtyRegionResize(&canvas->dirty, canvas->state.h);
+    // The string is parsed on its own, it can't finish or start a sequence
+    // that's being printed
+    rlutPanel *panel = rlut.panel;
+    AnsiParser parser;
+    std::swap(parser, rlut.ansi);
+    rlut.panel = canvas;
+    SwapDrawState(&canvas->state);
+    PrintText(str, length);
+    SwapDrawState(&canvas->state);
+    rlut.panel = panel;
+    std::swap(parser, rlut.ansi);
+}
+
+// Add the runs of cells that were printed to between columns `x0` + `x1` of a
+// canvas row, the runs are moved to row `line` starting at column 0
+static void AddTextRuns(rlutText *text, const CellBuffer *buf, unsigned int y, unsigned int x0, unsigned int x1, unsigned int line) {
+    for (unsigned int x = x0; x < x1;) {
+        if (!CellBufferGet(buf, x, y).used) {
+            x++;
+            continue;
+        }
+        TextRun run;
+        run.x = x - x0;
+        run.y = line;
+        run.offset = text->cells.size();
+        for (; x < x1; x++) {
+            Cell cell = CellBufferGet(buf, x, y);
+            if (!cell.used)
+                break;
+            text->cells.push_back(cell.value);
+        }
+        run.length = x - x0 - run.x;
+        text->runs.push_back(run);
+        text->w = std::max(text->w, x - x0);
+        text->h = line + 1;
+    }
+}
+
+static rlutText* CompileText(const char *str, size_t length) {
+    rlutPanel canvas;
+    PrintCanvas(&canvas, str, length);
+    rlutText *text = new rlutText;
+    text->w = text->h = 0;
+    for (unsigned int y = 0; y < canvas.cells.h; y++)
+        AddTextRuns(text, &canvas.cells, y, 0, canvas.cells.w, y);
+    CellBufferFree(&canvas.cells);
+    return text;
+}
+
+rlutText* rlutCompileTextV(const char *fmt, va_list args) {
+    char buffer[256];
+    int length;
+    char *str = FormatString(buffer, sizeof(buffer), &length, fmt, args);
+    if (!str)
+        return NULL;
+    rlutText *text = CompileText(str, length);
+    if (str != buffer)
+        RLUT_FREE(str);
+    return text;
+}
+
+rlutText* rlutCompileText(const char *fmt, ...) {
+    if (!strchr(fmt, '%'))
+        return CompileText(fmt, strlen(fmt));
+    va_list args;
+    va_start(args, fmt);
+    rlutText *text = rlutCompileTextV(fmt, args);
+    va_end(args);
+    return text;
+}
+
+void rlutDestroyText(rlutText *text) {
+    delete text;
+}
+
+void rlutTextSize(rlutText *text, unsigned int *width, unsigned int *height) {
+    if (width)
+        *width = text ? text->w : 0;
+    if (height)
+        *height = text ? text->h : 0;
+}
+
+static void DrawTextRun(CellBuffer *target, const rlutText *text, const TextRun *run, int x, int y) {
+    unsigned int w = run->length, h = 1, ox, oy;
+    if (!ClipRect(&x, &y, &w, &h, &ox, &oy))
+        return;
+    CellBufferBlit(target, x, y, w, 1, &text->cells[run->offset + ox], w);
+    MarkDirty(x, y, w, 1);
+}
+
+// Only the cells that were printed to are copied, the cursor isn't moved
+void rlutDrawText(rlutText *text, int x, int y) {
+    if (!text)
+        return;
+    if (!rlut.panel)
+        ResizeLayer(&rlut.layers[rlut.layer]);
+    CellBuffer *target = Target();
+    for (size_t i = 0; i < text->runs.size(); i++)
+        DrawTextRun(target, text, &text->runs[i], x + text->runs[i].x, y + text->runs[i].y);
+}
+
+static inline bool BlankCell(const CellBuffer *buf, unsigned int x, unsigned int y) {
+    Cell cell = CellBufferGet(buf, x, y);
+    return !cell.used || cell.character == ' ';
+}
+
+// Word wrap the rows of a string printed into a canvas to `width` columns,
+// the width of each line is added to `lines` so it can be aligned when drawn
+static rlutText* LayoutText(const char *str, size_t length, unsigned int width, std::vector<uint16_t> *lines) {
+    rlutPanel canvas;
+    PrintCanvas(&canvas, str, length);
+    const CellBuffer *buf = &canvas.cells;
+    rlutText *text = new rlutText;
+    text->w = text->h = 0;
+    // Rows after the last one printed to are left out
+    unsigned int rows = buf->h;
+    while (rows) {
+        unsigned int x = 0;
+        while (x < buf->w && !CellBufferGet(buf, x, rows - 1).used)
+            x++;
+        if (x < buf->w)
+            break;
+        rows--;
+    }
+    for (unsigned int y = 0; y < rows; y++) {
+        unsigned int n = buf->w;
+        while (n && BlankCell(buf, n - 1, y))
+            n--;
+        unsigned int start = 0;
+        do {
+            unsigned int end = n;
+            if (n - start > width) {
+                // Break at the last space that fits, the space itself can
+                // hang past the edge
+                end = start + width;
+                unsigned int space = end;
+                while (space > start && !BlankCell(buf, space, y))
+                    space--;
+                if (space > start)
+                    end = space;
+                else if (CellBufferGet(buf, end, y).character == RLUT_WIDE_CONTINUATION && end - 1 > start)
+                    end--; // Words longer than the box are split, but not 2 column characters
+            }
+            unsigned int last = end;
+            while (last > start && BlankCell(buf, last - 1, y))
+                last--;
+            AddTextRuns(text, buf, y, start, last, lines->size());
+            lines->push_back(last - start);
+            // Spaces at the break are dropped
+            for (start = end; start < n && BlankCell(buf, start, y); start++);
+        } while (start < n);
+    }
+    text->h = lines->size();
+    CellBufferFree(&canvas.cells);
+    return text;
+}
+
+static uint64_t HashBytes(const char *str, size_t length, uint64_t hash) {
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t)str[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+static void ClearLayouts(void) {
+    LayoutCache *cache = &rlut.layouts;
+    for (size_t i = 0; i < cache->entries.size(); i++)
+        rlutDestroyText(cache->entries[i].text);
+    cache->entries.clear();
+    cache->slots.clear();
+}
+
+static void InsertLayoutSlot(LayoutCache *cache, int index) {
+    unsigned int mask = cache->slots.size() - 1;
+    unsigned int slot = cache->entries[index].hash & mask;
+    while (cache->slots[slot] >= 0)
+        slot = (slot + 1) & mask;
+    cache->slots[slot] = index;
+}
+
+// Find the layout of a string, laying it out if it isn't cached already
+static const Layout* FindLayout(const char *str, size_t length, unsigned int width) {
+    LayoutCache *cache = &rlut.layouts;
+    uint32_t style = rlut.textMode | rlut.foregroundColor << 8 | rlut.backgroundColor << 16;
+    uint64_t hash = HashBytes(str, length, 0xCBF29CE484222325ULL);
+    hash = (hash ^ width) * 0x100000001B3ULL;
+    hash = (hash ^ style) * 0x100000001B3ULL;
+    if (cache->slots.empty()) {
+        cache->slots.assign(RLUT_LAYOUT_CACHE_SIZE * 2, -1);
+        cache->entries.reserve(RLUT_LAYOUT_CACHE_SIZE);
+    }
+    unsigned int mask = cache->slots.size() - 1;
+    for (unsigned int slot = hash & mask; cache->slots[slot] >= 0; slot = (slot + 1) & mask) {
+        Layout *layout = &cache->entries[cache->slots[slot]];
+        if (layout->hash == hash && layout->width == width && layout->style == style &&
+            layout->str.size() == length && !memcmp(layout->str.data(), str, length)) {
+            layout->lastUsed = ++cache->clock;
+            return layout;
+        }
+    }
+    // Not cached, replace the least recently used layout once the cache is full
+    int index = cache->entries.size();
+    if (index < RLUT_LAYOUT_CACHE_SIZE) {
+        cache->entries.push_back(Layout());
+        cache->entries[index].hash = hash;
+        InsertLayoutSlot(cache, index);
+    } else {
+        index = 0;
+        for (int i = 1; i < RLUT_LAYOUT_CACHE_SIZE; i++)
+            if (cache->entries[i].lastUsed < cache->entries[index].lastUsed)
+                index = i;
+        rlutDestroyText(cache->entries[index].text);
+        // Removing from a linear probed table would leave holes, rebuilding
+        // it is cheap next to laying out the string
+        cache->entries[index].hash = hash;
+        std::fill(cache->slots.begin(), cache->slots.end(), -1);
+        for (int i = 0; i < RLUT_LAYOUT_CACHE_SIZE; i++)
+            InsertLayoutSlot(cache, i);
+    }
+    Layout *layout = &cache->entries[index];
+    layout->width = width;
+    layout->style = style;
+    layout->str.assign(str, length);
+    layout->lines.clear();
+    layout->text = LayoutText(str, length, width, &layout->lines);
+    layout->lastUsed = ++cache->clock;
+    return layout;
+}
+
+static const Layout* FormatLayout(unsigned int width, const char *fmt, va_list args) {
+    if (!strchr(fmt, '%'))
+        return FindLayout(fmt, strlen(fmt), width);
+    char buffer[256];
+    int length;
+    char *str = FormatString(buffer, sizeof(buffer), &length, fmt, args);
+    if (!str)
+        return NULL;
+    const Layout *layout = FindLayout(str, length, width);
+    if (str != buffer)
+        RLUT_FREE(str);
+    return layout;
+}
+
+unsigned int rlutDrawTextBox(int x, int y, unsigned int width, int align, const char *fmt, ...) {
+    if (!width)
+        return 0;
     va_list args;
     va_start(args, fmt);
-    std::stringstream ss;
-    int length = vsnprintf(NULL, 0, fmt, args);
-    std::vector<char> buffer(length + 1);
+    const Layout *layout = FormatLayout(width, fmt, args);
     va_end(args);
+    if (!layout)
+        return 0;
+    if (!rlut.panel)
+        ResizeLayer(&rlut.layers[rlut.layer]);
+    CellBuffer *target = Target();
+    const rlutText *text = layout->text;
+    for (size_t i = 0; i < text->runs.size(); i++) {
+        const TextRun *run = &text->runs[i];
+        unsigned int space = width - std::min(width, (unsigned int)layout->lines[run->y]);
+        int offset = align == RLUT_ALIGN_CENTER ? space / 2 : align == RLUT_ALIGN_RIGHT ? space : 0;
+        DrawTextRun(target, text, run, x + offset + run->x, y + run->y);
+    }
+    return text->h;
+}
+
+unsigned int rlutMeasureTextBox(unsigned int width, const char *fmt, ...) {
+    if (!width)
+        return 0;
+    va_list args;
     va_start(args, fmt);
-    vsnprintf(buffer.data(), buffer.size(), fmt, args);
+    const Layout *layout = FormatLayout(width, fmt, args);
     va_end(args);
-    ss << buffer.data();
-    std::string str = ss.str();
-    // Loop through string and parse any ANSI escapes and control codes
-    const char *_p = str.c_str();
-    char *p = (char*)_p;
-    for (; *p; p++) {
-        switch (*p) {
-            case '\a': // Bell
-                rlutBeep();
+    return layout ? layout->text->h : 0;
+}
+
+static void* PushCommand(rlutCommandBuffer *buffer, uint32_t type, size_t size) {
+    size_t offset = buffer->arena.size();
+    size = (size + 7) & ~(size_t)7;
+    buffer->arena.resize(offset + sizeof(Command) + size);
+    Command *command = (Command*)&buffer->arena[offset];
+    command->type = type;
+    command->size = size;
+    return command + 1;
+}
+
+static void FillRect(int x, int y, unsigned int w, unsigned int h, uint64_t cell) {
+    if (!rlut.panel)
+        ResizeLayer(&rlut.layers[rlut.layer]);
+    unsigned int ox, oy;
+    if (!ClipRect(&x, &y, &w, &h, &ox, &oy))
+        return;
+    CellBufferFill(Target(), x, y, w, h, cell);
+    MarkDirty(x, y, w, h);
+}
+
+// Commands change the cursor + text style like the functions they were
+// recorded from. Every buffer starts outside of any panel with a parser of its
+// own, so an escape or UTF-8 sequence cut off at the end of one buffer can't
+// run into the next. Any panel is ended + the layer is put back afterwards
+static void ApplyCommands(const std::vector<uint8_t> &arena) {
+    unsigned int layer = rlut.layer;
+    AnsiParser parser;
+    std::swap(parser, rlut.ansi);
+    bool skip = false;
+    for (size_t i = 0; i < arena.size(); i += sizeof(Command) + ((const Command*)&arena[i])->size) {
+        const Command *command = (const Command*)&arena[i];
+        const void *args = command + 1;
+        if (skip && command->type != RLUT_COMMAND_PANEL)
+            continue;
+        switch (command->type) {
+            case RLUT_COMMAND_LAYER:
+                rlutLayer(*(const unsigned int*)args);
                 break;
-            case '\b': // Backspace
-                rlutMoveCursor(-1, 0);
+            case RLUT_COMMAND_PANEL: {
+                // Panels destroyed since the buffer was recorded are skipped,
+                // along with everything drawn to them
+                rlutPanel *target = *(rlutPanel* const*)args;
+                rlutPanelEnd();
+                skip = target && std::find(rlut.panels.begin(), rlut.panels.end(), target) == rlut.panels.end();
+                if (target && !skip)
+                    rlutPanelBegin(target);
                 break;
-            case '\e': // Escape sequence
-                p = ParseANSIEscape(p + 1);
+            }
+            case RLUT_COMMAND_CLEAR:
+                rlutClearScreen();
                 break;
-            case '\n': // Line Feed
-                rlut.cursorX = 0;
-            case '\f':
-            case '\v': // Form feed + Vertical tab
-                if (rlut.cursorY != rlut.screenH - 1)
-                    rlut.cursorY++;
+            case RLUT_COMMAND_SET_CURSOR: {
+                const unsigned int *position = (const unsigned int*)args;
+                rlutSetCursor(position[0], position[1]);
                 break;
-            case '\r': // Carriage Return
-                rlut.cursorX = 0;
+            }
+            case RLUT_COMMAND_PRINT_CHAR: {
+                Cell cell = (Cell){.value=*(const uint64_t*)args};
+                rlutPrintChar(cell.character, cell.mode, cell.foreground, cell.background);
                 break;
-            case '\t': // Tab
-                if (rlut.cursorX == rlut.screenW - 1) {
-                    if (rlut.cursorY != rlut.screenH - 1) {
-                        rlut.cursorY++;
-                        rlut.cursorX = 0;
-                    }
-                } else
-                    rlut.cursorX = std::min((rlut.cursorX + 7) & ~7, rlut.screenW - 1);
+            }
+            case RLUT_COMMAND_PRINT: {
+                const uint64_t *length = (const uint64_t*)args;
+                rlutPrintStringN((const char*)(length + 1), *length);
                 break;
-            // Not an escape or control code, probably a character, print it
-            default:
-                rlutPrintChar(*p, rlut.textMode, rlut.foregroundColor, rlut.backgroundColor);
-                if (rlut.hints[RLUT_HINT_DISABLE_TEXT_AUTO_ADVANCE])
-                    rlutMoveCursor(+1, 0);
+            }
+            case RLUT_COMMAND_BLIT: {
+                const CommandRect *rect = (const CommandRect*)args;
+                rlutBlitCells((const uint64_t*)(rect + 1), rect->w, rect->h, rect->w, rect->x, rect->y);
                 break;
+            }
+            case RLUT_COMMAND_FILL: {
+                const CommandRect *rect = (const CommandRect*)args;
+                FillRect(rect->x, rect->y, rect->w, rect->h, rect->cell);
+                break;
+            }
+        }
+    }
+    rlutPanelEnd();
+    rlut.layer = layer;
+    std::swap(parser, rlut.ansi);
+}
+
+static bool CommandOrder(const SubmittedCommands &a, const SubmittedCommands &b) {
+    if (a.order != b.order)
+        return a.order < b.order;
+    if (a.id != b.id)
+        return a.id < b.id;
+    return a.sequence < b.sequence;
+}
+
+// Apply every buffer submitted since the last frame, sorted by their order
+// keys so the result doesn't depend on which thread submitted first
+static void ApplyCommandBuffers(void) {
+    CommandQueue *queue = &rlut.commands;
+    std::vector<SubmittedCommands> pending;
+    {
+        std::lock_guard<std::mutex> lock(queue->lock);
+        pending.swap(queue->pending);
+    }
+    if (pending.empty())
+        return;
+    std::sort(pending.begin(), pending.end(), CommandOrder);
+    for (size_t i = 0; i < pending.size(); i++)
+        ApplyCommands(pending[i].arena);
+    std::lock_guard<std::mutex> lock(queue->lock);
+    for (size_t i = 0; i < pending.size(); i++) {
+        pending[i].arena.clear();
+        queue->spare.push_back(std::move(pending[i].arena));
+    }
+}
+
+static void ClearCommandBuffers(void) {
+    std::lock_guard<std::mutex> lock(rlut.commands.lock);
+    rlut.commands.pending.clear();
+    rlut.commands.spare.clear();
+}
+
+rlutCommandBuffer* rlutCreateCommandBuffer(int order) {
+    rlutCommandBuffer *buffer = new rlutCommandBuffer;
+    buffer->order = order;
+    std::lock_guard<std::mutex> lock(rlut.commands.lock);
+    buffer->id = rlut.commands.nextId++;
+    return buffer;
+}
+
+void rlutDestroyCommandBuffer(rlutCommandBuffer *buffer) {
+    delete buffer;
+}
+
+void rlutCommandLayer(rlutCommandBuffer *buffer, unsigned int layer) {
+    *(unsigned int*)PushCommand(buffer, RLUT_COMMAND_LAYER, sizeof(layer)) = layer;
+}
+
+// Only the pointer is recorded, the panel has to outlive the submitted buffer.
+// A panel that was destroyed by the time the buffer is applied is skipped, but
+// a new panel allocated at the same address would be drawn to instead
+void rlutCommandPanel(rlutCommandBuffer *buffer, rlutPanel *panel) {
+    *(rlutPanel**)PushCommand(buffer, RLUT_COMMAND_PANEL, sizeof(panel)) = panel;
+}
+
+void rlutCommandClearScreen(rlutCommandBuffer *buffer) {
+    PushCommand(buffer, RLUT_COMMAND_CLEAR, 0);
+}
+
+void rlutCommandSetCursor(rlutCommandBuffer *buffer, unsigned int x, unsigned int y) {
+    unsigned int *position = (unsigned int*)PushCommand(buffer, RLUT_COMMAND_SET_CURSOR, 2 * sizeof(unsigned int));
+    position[0] = x;
+    position[1] = y;
+}
+
+void rlutCommandPrintChar(rlutCommandBuffer *buffer, uint32_t ch, int8_t mode, uint8_t fg, uint8_t bg) {
+    *(uint64_t*)PushCommand(buffer, RLUT_COMMAND_PRINT_CHAR, sizeof(uint64_t)) = RLUT_CELL(ch, mode, fg, bg);
+}
+
+void rlutCommandPrintStringN(rlutCommandBuffer *buffer, const char *str, size_t length) {
+    uint64_t *args = (uint64_t*)PushCommand(buffer, RLUT_COMMAND_PRINT, sizeof(uint64_t) + length);
+    *args = length;
+    memcpy(args + 1, str, length);
+}
+
+// Strings are formatted when they're recorded, escapes are parsed when applied
+void rlutCommandPrintStringV(rlutCommandBuffer *buffer, const char *fmt, va_list args) {
+    char local[256];
+    int length;
+    char *str = FormatString(local, sizeof(local), &length, fmt, args);
+    if (!str)
+        return;
+    rlutCommandPrintStringN(buffer, str, length);
+    if (str != local)
+        RLUT_FREE(str);
+}
+
+void rlutCommandPrintString(rlutCommandBuffer *buffer, const char *fmt, ...) {
+    if (!strchr(fmt, '%')) {
+        rlutCommandPrintStringN(buffer, fmt, strlen(fmt));
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    rlutCommandPrintStringV(buffer, fmt, args);
+    va_end(args);
+}
+
+// The cells are copied into the buffer, clipping happens when it's applied
+void rlutCommandBlitCells(rlutCommandBuffer *buffer, const uint64_t *cells, unsigned int w, unsigned int h, unsigned int stride, int x, int y) {
+    if (!cells || !w || !h)
+        return;
+    CommandRect *rect = (CommandRect*)PushCommand(buffer, RLUT_COMMAND_BLIT, sizeof(CommandRect) + (size_t)w * h * sizeof(uint64_t));
+    rect->x = x;
+    rect->y = y;
+    rect->w = w;
+    rect->h = h;
+    rect->cell = 0;
+    uint64_t *dst = (uint64_t*)(rect + 1);
+    for (unsigned int row = 0; row < h; row++)
+        memcpy(dst + (size_t)row * w, cells + (size_t)row * stride, w * sizeof(uint64_t));
+}
+
+void rlutCommandFill(rlutCommandBuffer *buffer, uint64_t cell, int x, int y, unsigned int w, unsigned int h) {
+    CommandRect *rect = (CommandRect*)PushCommand(buffer, RLUT_COMMAND_FILL, sizeof(CommandRect));
+    rect->x = x;
+    rect->y = y;
+    rect->w = w;
+    rect->h = h;
+    rect->cell = cell;
+}
+
+// Hand the recorded commands to the main thread, they're applied after the
+// display callback of the next frame. The buffer is empty again afterwards
+// and can be recorded into straight away
+void rlutSubmitCommandBuffer(rlutCommandBuffer *buffer) {
+    if (!buffer || buffer->arena.empty())
+        return;
+    CommandQueue *queue = &rlut.commands;
+    {
+        std::lock_guard<std::mutex> lock(queue->lock);
+        SubmittedCommands submitted;
+        submitted.order = buffer->order;
+        submitted.id = buffer->id;
+        submitted.sequence = buffer->sequence++;
+        submitted.arena.swap(buffer->arena);
+        if (!queue->spare.empty()) {
+            buffer->arena.swap(queue->spare.back());
+            queue->spare.pop_back();
         }
+        queue->pending.push_back(std::move(submitted));
     }
+    rlutPostRedisplay();
+}
+
+int rlutReadCell(unsigned int x, unsigned int y, uint32_t *character, int8_t *mode, uint8_t *fg, uint8_t *bg) {
+    if (x >= rlut.screenW || y >= rlut.screenH || rlut.frontBuffer.size() != rlut.screenW * rlut.screenH)
+        return 0;
+    Cell cell = (Cell){.value=rlut.frontBuffer[y * rlut.screenW + x]};
+    if (character)
+        *character = cell.character;
+    if (mode)
+        *mode = cell.mode;
+    if (fg)
+        *fg = cell.foreground;
+    if (bg)
+        *bg = cell.background;
+    return 1;
+}
+
+// Copy the last presented frame into separate planes, `stride` is the number
+// of elements between each row. Any plane can be NULL to skip it
+// Rows wider than `stride` are cut off at `stride` columns
+void rlutReadFrame(uint32_t *characters, uint8_t *fg, uint8_t *bg, unsigned int stride) {
+    if (rlut.frontBuffer.size() != rlut.screenW * rlut.screenH)
+        return;
+    unsigned int width = std::min(stride, rlut.screenW);
+    for (unsigned int y = 0; y < rlut.screenH; y++) {
+        const uint64_t *row = &rlut.frontBuffer[y * rlut.screenW];
+        for (unsigned int x = 0; x < width; x++) {
+            Cell cell = (Cell){.value=row[x]};
+            if (characters)
+                characters[y * stride + x] = cell.character;
+            if (fg)
+                fg[y * stride + x] = cell.foreground;
+            if (bg)
+                bg[y * stride + x] = cell.background;
+        }
+    }
+}
+
+const uint8_t* rlutReadPixels(unsigned int *width, unsigned int *height) {
+    if (width)
+        *width = rlut.pixel.width;
+    if (height)
+        *height = rlut.pixel.height;
+    return rlut.pixel.framebuffer.empty() ? NULL : reinterpret_cast<const uint8_t*>(rlut.pixel.framebuffer.data());
+}
+
+int rlutSavePPM(const char *path) {
+    if (rlut.pixel.framebuffer.empty())
+        return 0;
+    FILE *fh = fopen(path, "wb");
+    if (!fh)
+        return 0;
+    fprintf(fh, "P6\n%u %u\n255\n", rlut.pixel.width, rlut.pixel.height);
+    std::vector<uint8_t> row(rlut.pixel.width * 3);
+    const uint8_t *src = reinterpret_cast<const uint8_t*>(rlut.pixel.framebuffer.data());
+    for (unsigned int y = 0; y < rlut.pixel.height; y++) {
+        for (unsigned int x = 0; x < rlut.pixel.width; x++, src += 4)
+            memcpy(&row[x * 3], src, 3);
+        fwrite(row.data(), 1, row.size(), fh);
+    }
+    bool ok = !ferror(fh);
+    fclose(fh);
+    return ok;
 }
 
 #if defined(RLUT_SDL2)
@@ -759,7 +4466,7 @@ void rlutBeep(void) {
 }
 #else
 void rlutBeep(void) {
-    beep();
+    rlut.backend->beep();
 }
 #endif
 
@@ -23,6 +23,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdarg.h>
 
@@ -61,29 +62,77 @@ enum {
 enum {
     RLUT_HINT_DEFAULT_FOREGROUND_COLOR,
     RLUT_HINT_DEFAULT_BACKGROUND_COLOR,
-    RLUT_HINT_WINDOW_WIDTH, /* GUI version only */
-    RLUT_HINT_WINDOW_HEIGHT, /* GUI version only */
+    RLUT_HINT_WINDOW_WIDTH, /* Pixel backend only */
+    RLUT_HINT_WINDOW_HEIGHT, /* Pixel backend only */
     RLUT_HINT_DISABLE_TEXT_WRAP,
     RLUT_HINT_DISABLE_TEXT_AUTO_ADVANCE,
     RLUT_HINT_ENABLE_Y_WRAP,
-    RLUT_HINT_DISABLE_UTF8, /* TODO */
+    RLUT_HINT_DISABLE_UTF8, /* Strings are printed a byte per cell, nothing takes up 2 columns */
     RLUT_HINT_DISABLE_RUNNING_COLOR,
-    RLUT_HINT_INITIAL_SEED
+    RLUT_HINT_INITIAL_SEED,
+    RLUT_HINT_BACKEND, /* TUI version only, set before rlutInit */
+    RLUT_HINT_ENABLE_TRUECOLOR, /* VT backend only */
+    RLUT_HINT_HEADLESS_COLUMNS, /* Headless backend only */
+    RLUT_HINT_HEADLESS_ROWS, /* Headless backend only */
+    RLUT_HINT_DISABLE_IMGUI, /* Set before rlutInit, always set if built with RLUT_NO_IMGUI */
+    RLUT_HINT_FRAME_RATE,
+    RLUT_HINT_ENABLE_EVENT_LOOP, /* Only run frames on input, timers or rlutPostRedisplay */
+    RLUT_HINT_RECORD_KEYFRAME_INTERVAL, /* Frames between each keyframe of a recording */
+    RLUT_HINT_SHOW_FRAME_STATS, /* Draw frame timings in the top right corner */
+    RLUT_HINT_COMPOSITOR_THREADS /* Number of row bands composed in parallel */
 };
 
-#define RLUT_HINT_LAST RLUT_HINT_INITIAL_SEED
+#define RLUT_HINT_LAST RLUT_HINT_COMPOSITOR_THREADS
+
+enum {
+    RLUT_BACKEND_NCURSES = 0,
+    RLUT_BACKEND_VT, /* Writes escape sequences directly, NCurses is only used for input */
+    RLUT_BACKEND_HEADLESS, /* Never touches the terminal, see rlutReadFrame */
+    RLUT_BACKEND_PIXEL /* Software renderer, shown in a window when built with RLUT_SDL2 */
+};
+
+enum {
+    RLUT_LAYER_TRANSPARENT = 0, /* Unused cells show the layers below */
+    RLUT_LAYER_OPAQUE, /* Every cell covers the layers below */
+    RLUT_LAYER_KEEP_BACKGROUND, /* Like transparent but keeps the background color below */
+    RLUT_LAYER_HIDDEN
+};
+
+enum {
+    RLUT_ALIGN_LEFT = 0,
+    RLUT_ALIGN_CENTER,
+    RLUT_ALIGN_RIGHT
+};
+
+enum {
+    RLUT_PHASE_INPUT = 0, /* Timers + backend input */
+    RLUT_PHASE_IMGUI, /* Starting the ImGui frame */
+    RLUT_PHASE_DISPLAY, /* Preframe + display callbacks */
+    RLUT_PHASE_RENDER, /* Rendering ImGui into the ImTui screen */
+    RLUT_PHASE_COMPOSE,
+    RLUT_PHASE_OUTPUT, /* Drawing the changes to the backend */
+    RLUT_PHASE_WAIT, /* Waiting for the next frame */
+    RLUT_PHASE_FRAME, /* Whole frame, including waiting */
+    RLUT_PHASE_COUNT
+};
+
+/* Times are in milliseconds, over the last 128 frames */
+typedef struct {
+    float min, avg, p99;
+} rlutPhaseStats;
+
+typedef struct {
+    rlutPhaseStats phases[RLUT_PHASE_COUNT];
+    unsigned int frames; /* Number of frames the times are from */
+    uint64_t bytesWritten, cellsChanged, pairSwitches; /* Last frame, bytes are VT backend only */
+    uint64_t totalBytesWritten, totalCellsChanged, totalPairSwitches;
+} rlutFrameStats;
 
 // TODO: Text Modes (bold, italics)
 // TODO: Input + event handling + forwarding
 // TODO: Try and generate wrapper for ImGui
 // TODO: A*, Poisson disc sampling, FOV functions
 // TODO: Alternate SDL GUI version (after TUI version is finished)
-// TODO: UTF-8 support for PrintChar + PrintString
-// TODO: Panel API
-//  - Panels are boxes that you can write text to like the main buffer
-//  - API will handle rendering + text-wrapping
-//  - Push/Pop immediate mode style
-// TODO: Build without ImGui/ImTui option
 // TODO: Simple event emitter
 
 // Windows + context functions
@@ -94,18 +143,107 @@ void rlutPreframeFunc(void(*func)(void));
 void rlutPostframeFunc(void(*func)(void));
 void rlutReshapeFunc(void(*func)(int columns, int rows));
 void rlutAtExit(void(*func)(void));
+void rlutTimerFunc(unsigned int msecs, void(*func)(int value), int value);
+void rlutPostRedisplay(void);
 void rlutKillLoop(void);
 int rlutMainLoop(void);
+int rlutMainLoopEvent(void);
 void rlutBeep(void);
+void rlutGetFrameStats(rlutFrameStats *stats);
 
 // Cursor + screen state functions
 void rlutClearScreen(void);
+void rlutScrollRegion(unsigned int top, unsigned int bottom, int n);
 void rlutMoveCursor(int x, int y);
 void rlutSetCursor(unsigned int x, unsigned int y);
 void rlutScreenSize(unsigned int *width, unsigned int *height);
 void rlutCursorPosition(unsigned int *x, unsigned int *y);
 void rlutPrintChar(uint32_t ch, int8_t mode, uint8_t foregroundColor, uint8_t backgroundColor);
 void rlutPrintString(const char *fmt, ...);
+void rlutPrintStringV(const char *fmt, va_list args);
+void rlutPrintStringN(const char *str, size_t length); /* Printed as is, without formatting */
+
+// Compiled text functions, strings are parsed once (escapes, UTF-8 + the text
+// style when compiled) into runs of cells. Drawing copies the cells that were
+// printed to without moving the cursor
+typedef struct rlutText rlutText;
+rlutText* rlutCompileText(const char *fmt, ...);
+rlutText* rlutCompileTextV(const char *fmt, va_list args);
+void rlutDestroyText(rlutText *text);
+void rlutTextSize(rlutText *text, unsigned int *width, unsigned int *height);
+void rlutDrawText(rlutText *text, int x, int y);
+
+// Text box functions, strings are word wrapped to `width` columns. Lines are
+// broken at spaces + newlines, words longer than the box are split. Layouts
+// are cached by the string, width + text style. Both return the number of rows
+unsigned int rlutDrawTextBox(int x, int y, unsigned int width, int align, const char *fmt, ...);
+unsigned int rlutMeasureTextBox(unsigned int width, const char *fmt, ...);
+
+// Layer functions, everything is drawn to the selected layer. Only the parts of
+// the layers that were drawn to are flattened each frame. Layer modes only
+// apply to layers above the base layer (0)
+void rlutLayer(unsigned int layer);
+void rlutLayerMode(unsigned int layer, int mode);
+
+// Panel functions, panels are boxes drawn over every layer that can be written
+// to like the screen. Between rlutPanelBegin + rlutPanelEnd every draw function
+// writes to the panel using the panel's own cursor + text style
+typedef struct rlutPanel rlutPanel;
+rlutPanel* rlutCreatePanel(int x, int y, unsigned int width, unsigned int height);
+void rlutDestroyPanel(rlutPanel *panel);
+void rlutMovePanel(rlutPanel *panel, int x, int y);
+void rlutPanelBegin(rlutPanel *panel);
+void rlutPanelEnd(void);
+
+// Bulk drawing functions, rectangles are clipped to the screen. `stride` is the
+// number of elements between each row of the source. `foregroundColors` and
+// `backgroundColors` can be NULL to use the current colors
+#define RLUT_WIDE_CONTINUATION 0xFFFFFFFFu /* Character of the cell to the right of a 2 column character */
+#define RLUT_CELL(CH, MODE, FG, BG) ((uint64_t)(uint32_t)(CH) | (uint64_t)(uint8_t)(MODE) << 32 | (uint64_t)(uint8_t)(FG) << 40 | (uint64_t)(uint8_t)(BG) << 48 | (uint64_t)1 << 56)
+void rlutBlit(const uint32_t *characters, const uint8_t *foregroundColors, const uint8_t *backgroundColors, unsigned int width, unsigned int height, unsigned int stride, int x, int y);
+void rlutBlitCells(const uint64_t *cells, unsigned int width, unsigned int height, unsigned int stride, int x, int y);
+
+// Command buffer functions, draw calls are recorded into a buffer on any
+// thread and applied on the main thread after the display callback. Submitted
+// buffers are applied in `order`, then by creation + submission order. Each
+// buffer should only be used by one thread at a time
+typedef struct rlutCommandBuffer rlutCommandBuffer;
+rlutCommandBuffer* rlutCreateCommandBuffer(int order);
+void rlutDestroyCommandBuffer(rlutCommandBuffer *buffer);
+void rlutCommandLayer(rlutCommandBuffer *buffer, unsigned int layer);
+void rlutCommandPanel(rlutCommandBuffer *buffer, rlutPanel *panel); /* NULL ends the panel, the panel must outlive the submitted buffer */
+void rlutCommandClearScreen(rlutCommandBuffer *buffer);
+void rlutCommandSetCursor(rlutCommandBuffer *buffer, unsigned int x, unsigned int y);
+void rlutCommandPrintChar(rlutCommandBuffer *buffer, uint32_t ch, int8_t mode, uint8_t foregroundColor, uint8_t backgroundColor);
+void rlutCommandPrintString(rlutCommandBuffer *buffer, const char *fmt, ...);
+void rlutCommandPrintStringV(rlutCommandBuffer *buffer, const char *fmt, va_list args);
+void rlutCommandPrintStringN(rlutCommandBuffer *buffer, const char *str, size_t length);
+void rlutCommandBlitCells(rlutCommandBuffer *buffer, const uint64_t *cells, unsigned int width, unsigned int height, unsigned int stride, int x, int y);
+void rlutCommandFill(rlutCommandBuffer *buffer, uint64_t cell, int x, int y, unsigned int width, unsigned int height);
+void rlutSubmitCommandBuffer(rlutCommandBuffer *buffer);
+
+// Frame read back functions (last frame that was presented). rlutReadFrame
+// writes a row for every row of the screen, `stride` elements apart. Only the
+// first `stride` columns of each row are written
+int rlutReadCell(unsigned int x, unsigned int y, uint32_t *character, int8_t *mode, uint8_t *foregroundColor, uint8_t *backgroundColor);
+void rlutReadFrame(uint32_t *characters, uint8_t *foregroundColors, uint8_t *backgroundColors, unsigned int stride);
+
+// Pixel backend functions, pixels are 4 bytes each (R, G, B, A)
+const uint8_t* rlutReadPixels(unsigned int *width, unsigned int *height);
+int rlutSavePPM(const char *path);
+
+// Recording functions, every presented frame is appended to the file until
+// recording is stopped. Starting a recording replaces any existing file.
+// Recordings are played back a frame at a time
+typedef struct rlutRecording rlutRecording;
+int rlutStartRecording(const char *path);
+void rlutStopRecording(void);
+rlutRecording* rlutOpenRecording(const char *path);
+void rlutCloseRecording(rlutRecording *recording);
+void rlutRecordingInfo(rlutRecording *recording, unsigned int *columns, unsigned int *rows, unsigned int *frames, unsigned int *frame);
+int rlutNextRecordingFrame(rlutRecording *recording);
+int rlutSeekRecording(rlutRecording *recording, unsigned int frame);
+const uint64_t* rlutRecordingCells(rlutRecording *recording);
 
 // RNG + seed functions
 void rlutSetSeed(uint64_t seed);